@@ -1,7 +1,42 @@
 #pragma once
 
 #include <cstdio>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+
+#ifdef MINI_TIFF_INSTRUMENTATION
+#include <chrono>
+#endif
+
+// Hardware conversion of half floats. Enabled when compiling with -mf16c (or /arch:AVX2 in msvc)
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define MINI_TIFF_F16C
+#include <immintrin.h>
+#endif
+
+// JPEG compressed images (compression 7) are decoded with libjpeg. Link with -ljpeg
+#ifdef MINI_TIFF_JPEG
+#include <csetjmp>
+#include <jpeglib.h>
+#endif
+
+#ifndef _WIN32
+#include <cerrno>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 
 /*
 	Usage:
@@ -47,8 +82,30 @@ namespace MiniTiff {
 	static constexpr uint16_t IFD_XMLPacket = 0x02BC;
 	static constexpr uint16_t IFD_Photoshop = 0x8649;
 	static constexpr uint16_t IFD_PlanarConfiguration = 0x011c;		// Interleaved?
-	static constexpr uint16_t IFD_Exif = 0x8769;
+	static constexpr uint16_t IFD_Exif = 0x8769;					// Offset of the Exif sub-IFD
+	static constexpr uint16_t IFD_GPS = 0x8825;						// Offset of the GPS sub-IFD
 	static constexpr uint16_t IFD_ICCProfile = 0x8773;
+	static constexpr uint16_t IFD_ColorMap = 0x0140;				// RGB colors of palette images
+	static constexpr uint16_t IFD_InkSet = 0x014C;					// 1:CMYK
+	static constexpr uint16_t IFD_YCbCrCoefficients = 0x0211;
+	static constexpr uint16_t IFD_YCbCrSubsampling = 0x0212;		// Horizontal and vertical factors of the chroma
+	static constexpr uint16_t IFD_YCbCrPositioning = 0x0213;
+	static constexpr uint16_t IFD_ReferenceBlackWhite = 0x0214;
+	static constexpr uint16_t IFD_TileWidth = 0x0142;
+	static constexpr uint16_t IFD_TileLength = 0x0143;
+	static constexpr uint16_t IFD_TileOffsets = 0x0144;
+	static constexpr uint16_t IFD_TileByteCounts = 0x0145;
+	static constexpr uint16_t IFD_JPEGTables = 0x015B;				// Quantization and huffman tables shared by all the strips/tiles
+
+	// Values of IFD_SampleFormat
+	static constexpr uint16_t SampleFormat_UInt = 1;
+	static constexpr uint16_t SampleFormat_Int = 2;
+	static constexpr uint16_t SampleFormat_Float = 3;
+
+	// Values of IFD_Compression
+	static constexpr uint16_t Compression_None = 1;
+	static constexpr uint16_t Compression_JPEG = 7;
+	static constexpr uint16_t Compression_PackBits = 32773;
 
 	struct Tags {
 		static const char* asStr( uint16_t tag_id ) {
@@ -77,7 +134,19 @@ namespace MiniTiff {
 			DECL_TAG_NAME(Photoshop);
 			DECL_TAG_NAME(PlanarConfiguration);
 			DECL_TAG_NAME(Exif);
+			DECL_TAG_NAME(GPS);
 			DECL_TAG_NAME(ICCProfile);
+			DECL_TAG_NAME(ColorMap);
+			DECL_TAG_NAME(InkSet);
+			DECL_TAG_NAME(YCbCrCoefficients);
+			DECL_TAG_NAME(YCbCrSubsampling);
+			DECL_TAG_NAME(YCbCrPositioning);
+			DECL_TAG_NAME(ReferenceBlackWhite);
+			DECL_TAG_NAME(TileWidth);
+			DECL_TAG_NAME(TileLength);
+			DECL_TAG_NAME(TileOffsets);
+			DECL_TAG_NAME(TileByteCounts);
+			DECL_TAG_NAME(JPEGTables);
 			#undef DECL_TAG_NAME
 			return "Unknown";
 		}
@@ -97,17 +166,14 @@ namespace MiniTiff {
 				field_type = swap16(field_type);
 				num_items = swap32(num_items);
 
-				if( id == IFD_BitsPerSample ) {
-					if( field_type == 3 && num_items == 1 )
-						value = swap16( value );
-					else 
-					  value = swap32( value );
-				} else {
-					if( field_type == 3 )
-						value = swap16(value);
-					else
-					  value = swap32( value );
-				}
+				// Shorts stored inline, first one in the low 16 bits. Bytes inline are not swapped.
+				// Otherwise the value is an int, or the offset to the values
+				if( (field_type == 3 || field_type == 8) && num_items <= 2 )
+					value = swap16( (uint16_t)value ) | ((uint32_t)swap16( (uint16_t)(value >> 16) ) << 16);
+				else if( (field_type == 1 || field_type == 2 || field_type == 6 || field_type == 7) && num_items <= 4 )
+					;
+				else
+				  value = swap32( value );
 			}
 
 			static uint32_t swap32( uint32_t x ) {
@@ -119,6 +185,9 @@ namespace MiniTiff {
 			static uint16_t swap16( uint16_t x ) {
 				return (x>>8) | (x<<8);
 			}
+			static uint64_t swap64( uint64_t x ) {
+				return ((uint64_t)swap32( (uint32_t)x ) << 32) | swap32( (uint32_t)(x >> 32) );
+			}
 		};
 
 		struct Header {
@@ -139,327 +208,3521 @@ namespace MiniTiff {
 			}
 		};
 
-	};
+		// Same interface as FileWriter, but writes into a fixed size memory block
+		struct BufferWriter {
+			uint8_t* buf = nullptr;
+			size_t   capacity = 0;
+			size_t   bytes_written = 0;
+			BufferWriter(uint8_t* new_buf, size_t new_capacity) : buf(new_buf), capacity(new_capacity) {}
+			bool writeBytes(const void* data, size_t num_bytes) {
+				if (bytes_written + num_bytes > capacity)
+					return false;
+				memcpy(buf + bytes_written, data, num_bytes);
+				bytes_written += num_bytes;
+				return true;
+			}
+			template< typename T >
+			bool write(T t) {
+				return writeBytes(&t, sizeof(T));
+			}
+		};
 
-	struct FileWriter {
-		FILE* f = nullptr;
-		size_t bytes_written = 0;
-		~FileWriter() {
-			if (f)
-				fclose(f);
-		}
-		bool create(const char* ofilename) {
-			f = fopen(ofilename, "wb");
-			return f != nullptr;
-		}
-		void writeBytes(const void* data, size_t num_bytes) {
-			fwrite(data, 1, num_bytes, f);
-			bytes_written += num_bytes;
-		}
-		template< typename T >
-		void write(T t) {
-			writeBytes(&t, sizeof(T));
+		// Conversion between 32 bits floats and 16 bits floats (half)
+		static inline float halfToFloat(uint16_t h) {
+			uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+			uint32_t exp = (h >> 10) & 0x1f;
+			uint32_t mant = h & 0x3ff;
+			uint32_t bits;
+			if (exp == 0) {
+				if (mant == 0) {
+					bits = sign;
+				} else {
+					// Denormal, normalize it
+					exp = 127 - 15 + 1;
+					while (!(mant & 0x400)) {
+						mant <<= 1;
+						--exp;
+					}
+					bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+				}
+			}
+			else if (exp == 31)
+				bits = sign | 0x7f800000 | (mant << 13);
+			else
+				bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+			float f;
+			memcpy(&f, &bits, sizeof(f));
+			return f;
 		}
-	};
 
-	struct FileReader {
-		FILE* f = nullptr;
-		size_t bytes_read = 0;
-		bool   swap_16b_data = false;
-		bool   swap_32b_data = false;
-		~FileReader() {
-			if (f)
-				fclose(f);
-		}
-		bool open(const char* ofilename) {
-			f = fopen(ofilename, "rb");
-			return f != nullptr;
+		// Rounds to nearest even
+		static inline uint16_t floatToHalf(float value) {
+			uint32_t x;
+			memcpy(&x, &value, sizeof(x));
+			uint32_t sign = (x >> 16) & 0x8000;
+			uint32_t exp = (x >> 23) & 0xff;
+			uint32_t mant = x & 0x7fffff;
+			if (exp == 0xff)
+				return (uint16_t)(sign | 0x7c00 | (mant ? 0x200 : 0));
+			int e = (int)exp - 127 + 15;
+			if (e >= 31)
+				return (uint16_t)(sign | 0x7c00);
+			if (e <= 0) {
+				// Denormal or zero
+				if (e < -10)
+					return (uint16_t)sign;
+				mant |= 0x800000;
+				int shift = 14 - e;
+				uint32_t h = mant >> shift;
+				uint32_t rem = mant & ((1u << shift) - 1);
+				uint32_t halfway = 1u << (shift - 1);
+				if (rem > halfway || (rem == halfway && (h & 1)))
+					++h;
+				return (uint16_t)(sign | h);
+			}
+			uint32_t h = sign | (e << 10) | (mant >> 13);
+			uint32_t rem = mant & 0x1fff;
+			// A carry into the exponent gives the right result, even infinity
+			if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+				++h;
+			return (uint16_t)h;
 		}
-		bool readBytes(void* data, size_t num_bytes) {
-			size_t n = fread(data, 1, num_bytes, f);
-			bytes_read += num_bytes;
 
-			// Swap component data inside the lib
-			if( swap_16b_data ) {
-				uint16_t* p = (uint16_t*) data;
-				for( int i=0; i<num_bytes/2; ++i, ++p ) 
-					*p = internal::IFDEntry::swap16(*p);
+		// src and dst may overlap as long as dst <= src, which allows converting in place
+		static void halfsToFloats(const uint16_t* src, float* dst, size_t n) {
+			size_t i = 0;
+#ifdef MINI_TIFF_F16C
+			for (; i + 8 <= n; i += 8) {
+				__m256 v = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i)));
+				_mm256_storeu_ps(dst + i, v);
 			}
-			else if( swap_32b_data ) {
-				uint32_t* p = (uint32_t*) data;
-				for( int i=0; i<num_bytes/4; ++i, ++p ) 
-					*p = internal::IFDEntry::swap32(*p);
+#endif
+			for (; i < n; ++i) {
+				uint16_t h;
+				memcpy(&h, src + i, sizeof(h));
+				float f = halfToFloat(h);
+				memcpy(dst + i, &f, sizeof(f));
 			}
-
-			return n == num_bytes;
 		}
-		template< typename T >
-		bool read(T& t) {
-			return readBytes(&t, sizeof(T));
-		}
-		void seek(uint32_t offset) {
-			fseek(f, offset, SEEK_SET);
-		}
-	};
 
-	static bool save(const char* ofilename, int w, int h, int num_components, int bits_per_component, const void* data ) {
+		static void floatsToHalfs(const float* src, uint16_t* dst, size_t n) {
+			size_t i = 0;
+#ifdef MINI_TIFF_F16C
+			for (; i + 8 <= n; i += 8) {
+				__m128i v = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+				_mm_storeu_si128((__m128i*)(dst + i), v);
+			}
+#endif
+			for (; i < n; ++i)
+				dst[i] = floatToHalf(src[i]);
+		}
 
-		using namespace internal;
+		// Components of less than 8 bits, or 12 bits, are packed in the file. The first
+		// component is in the most significant bits, and each row starts in a new byte.
+		static inline bool isPacked(int bits_per_component) {
+			return bits_per_component == 1 || bits_per_component == 2 || bits_per_component == 4 || bits_per_component == 12;
+		}
 
-		// Validate input parameters
-		if( ! ((w > 0)
-			&& (h > 0)
-			&& (bits_per_component == 8 || bits_per_component == 16 || bits_per_component == 32)
-			&& (num_components == 1 || num_components == 3 || num_components == 4)
-			&& (data)
-			))
-			return false;
+		// Unpacks n values of 1, 2 or 4 bits into one byte each
+		static void unpackBits(const uint8_t* src, uint8_t* dst, size_t n, int bits) {
+			size_t full_bytes = n * bits / 8;
+			if (bits == 1) {
+				for (size_t i = 0; i < full_bytes; ++i, dst += 8) {
+					uint8_t b = src[i];
+					dst[0] = (b >> 7) & 1; dst[1] = (b >> 6) & 1; dst[2] = (b >> 5) & 1; dst[3] = (b >> 4) & 1;
+					dst[4] = (b >> 3) & 1; dst[5] = (b >> 2) & 1; dst[6] = (b >> 1) & 1; dst[7] = b & 1;
+				}
+			}
+			else if (bits == 2) {
+				for (size_t i = 0; i < full_bytes; ++i, dst += 4) {
+					uint8_t b = src[i];
+					dst[0] = (b >> 6) & 3; dst[1] = (b >> 4) & 3; dst[2] = (b >> 2) & 3; dst[3] = b & 3;
+				}
+			}
+			else {
+				for (size_t i = 0; i < full_bytes; ++i, dst += 2) {
+					uint8_t b = src[i];
+					dst[0] = b >> 4; dst[1] = b & 15;
+				}
+			}
+			// The values in the last, incomplete byte
+			size_t remaining = n - full_bytes * 8 / bits;
+			uint8_t mask = (uint8_t)((1 << bits) - 1);
+			for (size_t k = 0; k < remaining; ++k)
+				dst[k] = (src[full_bytes] >> (8 - bits * (k + 1))) & mask;
+		}
 
-		FileWriter f;
-		if (!f.create(ofilename))
-			return false;
+		static void packBits(const uint8_t* src, uint8_t* dst, size_t n, int bits) {
+			uint8_t mask = (uint8_t)((1 << bits) - 1);
+			int values_per_byte = 8 / bits;
+			size_t i = 0;
+			for (; i + values_per_byte <= n; i += values_per_byte) {
+				uint8_t b = 0;
+				for (int k = 0; k < values_per_byte; ++k)
+					b = (uint8_t)((b << bits) | (src[i + k] & mask));
+				*dst++ = b;
+			}
+			if (i < n) {
+				uint8_t b = 0;
+				int k = 0;
+				for (; i < n; ++i, ++k)
+					b = (uint8_t)((b << bits) | (src[i] & mask));
+				*dst = (uint8_t)(b << (bits * (values_per_byte - k)));
+			}
+		}
 
-		f.write(Header{});
-
-		uint16_t num_ifds = 10;
-
-		// When saving floats, we store an additional IFDEntry entry
-		if( bits_per_component == 32 )
-			++num_ifds;
-
-		f.write(num_ifds);
-
-		uint32_t bytes_per_component = bits_per_component / 8;
-		uint32_t offset_for_data = 256;
-		uint32_t total_data_bytes = w * h * num_components * bytes_per_component;
-		uint32_t photometric_interpretation = (num_components == 1) ? 1 : 2;
-
-		// https://www.awaresystems.be/imaging/tiff/tifftags/baseline.html
-		f.write(IFDEntry(IFD_ImageType, 0));		// Image Type
-		f.write(IFDEntry(IFD_Width, w));			// width
-		f.write(IFDEntry(IFD_Height, h));			// Height
-		f.write(IFDEntry(IFD_BitsPerSample, bits_per_component));		// 8, 16 or 32
-		f.write(IFDEntry(IFD_Compression, 1));		// Compression : 1 = none
-		f.write(IFDEntry(IFD_PhotometricInterpretation, photometric_interpretation));		// PhotometricInterpretation : 2: RGB, 1:Grey
-		f.write(IFDEntry(IFD_OffsetForData, offset_for_data));	// StripOffsets : offset to start of actual data
-		f.write(IFDEntry(IFD_NumComponents, num_components));		// SamplesPerPixel : 3
-
-		if( bits_per_component == 32 )
-			f.write(IFDEntry(IFD_SampleFormat, 3));		// data are floats (3)
-
-		f.write(IFDEntry(IFD_RowsPerStrip, h));	// Height
-		f.write(IFDEntry(IFD_TotalBytesForData, total_data_bytes));
-		size_t num_padding_bytes = offset_for_data - f.bytes_written;
-		for (int i = 0; i < num_padding_bytes; ++i)
-			f.write((uint8_t)0x00);
-		f.writeBytes(data, total_data_bytes);
-		return true;
-	}
+		// Two values of 12 bits are stored in 3 bytes
+		static void unpack12(const uint8_t* src, uint16_t* dst, size_t n) {
+			size_t i = 0;
+			for (; i + 2 <= n; i += 2, src += 3) {
+				dst[i] = (uint16_t)((src[0] << 4) | (src[1] >> 4));
+				dst[i + 1] = (uint16_t)(((src[1] & 15) << 8) | src[2]);
+			}
+			if (i < n)
+				dst[i] = (uint16_t)((src[0] << 4) | (src[1] >> 4));
+		}
 
-	template< typename Fn >
-	static bool info(const char* ifilename, Fn fn ) {
+		static void pack12(const uint16_t* src, uint8_t* dst, size_t n) {
+			size_t i = 0;
+			for (; i + 2 <= n; i += 2, dst += 3) {
+				dst[0] = (uint8_t)(src[i] >> 4);
+				dst[1] = (uint8_t)(((src[i] & 15) << 4) | ((src[i + 1] >> 8) & 15));
+				dst[2] = (uint8_t)src[i + 1];
+			}
+			if (i < n) {
+				dst[0] = (uint8_t)(src[i] >> 4);
+				dst[1] = (uint8_t)((src[i] & 15) << 4);
+			}
+		}
 
-		using namespace internal;
+		// Swaps the bytes of each component of 2, 4 or 8 bytes
+		static void swapComponents(void* data, size_t num_bytes, int bytes_per_component) {
+			if (bytes_per_component == 2) {
+				uint16_t* p = (uint16_t*)data;
+				for (size_t i = 0; i < num_bytes / 2; ++i, ++p)
+					*p = IFDEntry::swap16(*p);
+			}
+			else if (bytes_per_component == 4) {
+				uint32_t* p = (uint32_t*)data;
+				for (size_t i = 0; i < num_bytes / 4; ++i, ++p)
+					*p = IFDEntry::swap32(*p);
+			}
+			else if (bytes_per_component == 8) {
+				uint64_t* p = (uint64_t*)data;
+				for (size_t i = 0; i < num_bytes / 8; ++i, ++p)
+					*p = IFDEntry::swap64(*p);
+			}
+		}
 
-		FileReader f;
-		if (!f.open(ifilename))
-			return false;
+		// Copies pixels of N bytes (pixel_bytes when N is 0) in blocks of 16x16, so the rows of src and dst
+		// touched by a block stay in the cache even when step_x jumps between rows of dst
+		template< size_t N >
+		static void copyPixels(const uint8_t* src, size_t src_row_bytes, size_t pixel_bytes, int cols, int rows, uint8_t* dst, ptrdiff_t step_x, ptrdiff_t step_y) {
+			const size_t n = N ? N : pixel_bytes;
+			const int block = 16;
+			for (int y0 = 0; y0 < rows; y0 += block) {
+				int y1 = (y0 + block < rows) ? y0 + block : rows;
+				for (int x0 = 0; x0 < cols; x0 += block) {
+					int x1 = (x0 + block < cols) ? x0 + block : cols;
+					for (int y = y0; y < y1; ++y) {
+						const uint8_t* s = src + y * src_row_bytes + x0 * n;
+						uint8_t* d = dst + y * step_y + x0 * step_x;
+						for (int x = x0; x < x1; ++x, s += n, d += step_x)
+							memcpy(d, s, n);
+					}
+				}
+			}
+		}
 
-		Header header;
-		f.read(header);
-		if (!header.isValid())
-			return false;
+		// The 8 values of IFD_Orientation as a linear map: the pixel x,y of the file goes to
+		// base + x * step_x + y * step_y in dst. Orientations 5..8 swap the width and height
+		struct Orientation {
+			bool      is_identity = true;
+			size_t    pixel_bytes = 0;
+			ptrdiff_t base = 0;
+			ptrdiff_t step_x = 0;
+			ptrdiff_t step_y = 0;
+
+			Orientation(int orientation, int w, int h, size_t new_pixel_bytes) : pixel_bytes(new_pixel_bytes) {
+				ptrdiff_t p = (ptrdiff_t)pixel_bytes;
+				bool is_transposed = orientation >= 5 && orientation <= 8;
+				ptrdiff_t row = (ptrdiff_t)(is_transposed ? h : w) * p;
+				ptrdiff_t last_x = w - 1;
+				ptrdiff_t last_y = h - 1;
+				is_identity = orientation < 2 || orientation > 8;
+				step_x = p;
+				step_y = row;
+				switch (orientation) {
+				case 2: base = last_x * p; step_x = -p; break;							// Mirrored horizontally
+				case 3: base = last_y * row + last_x * p; step_x = -p; step_y = -row; break;	// Rotated 180
+				case 4: base = last_y * row; step_y = -row; break;							// Mirrored vertically
+				case 5: step_x = row; step_y = p; break;									// Transposed
+				case 6: base = last_y * p; step_x = row; step_y = -p; break;				// Rotated 90 clockwise
+				case 7: base = last_x * row + last_y * p; step_x = -row; step_y = -p; break;	// Transverse
+				case 8: base = last_x * row; step_x = -row; step_y = p; break;				// Rotated 90 counter clockwise
+				}
+			}
 
-		bool swap_bytes = header.mustSwapBytes();
-		if( swap_bytes ) header.offset_first_ifd = IFDEntry::swap32( header.offset_first_ifd );
-		f.seek(header.offset_first_ifd);
+			// Copies cols x rows pixels found at x,y of the file to its place in dst
+			void copy(const uint8_t* src, size_t src_row_bytes, int cols, int rows, uint8_t* dst, int x, int y) const {
+				dst += base + x * step_x + y * step_y;
+				// Flips keep the pixels of a row together
+				if (step_x == (ptrdiff_t)pixel_bytes) {
+					for (int r = 0; r < rows; ++r)
+						memcpy(dst + r * step_y, src + r * src_row_bytes, cols * pixel_bytes);
+					return;
+				}
+				switch (pixel_bytes) {
+				case 1: copyPixels<1>(src, src_row_bytes, pixel_bytes, cols, rows, dst, step_x, step_y); break;
+				case 2: copyPixels<2>(src, src_row_bytes, pixel_bytes, cols, rows, dst, step_x, step_y); break;
+				case 3: copyPixels<3>(src, src_row_bytes, pixel_bytes, cols, rows, dst, step_x, step_y); break;
+				case 4: copyPixels<4>(src, src_row_bytes, pixel_bytes, cols, rows, dst, step_x, step_y); break;
+				case 6: copyPixels<6>(src, src_row_bytes, pixel_bytes, cols, rows, dst, step_x, step_y); break;
+				case 8: copyPixels<8>(src, src_row_bytes, pixel_bytes, cols, rows, dst, step_x, step_y); break;
+				case 12: copyPixels<12>(src, src_row_bytes, pixel_bytes, cols, rows, dst, step_x, step_y); break;
+				case 16: copyPixels<16>(src, src_row_bytes, pixel_bytes, cols, rows, dst, step_x, step_y); break;
+				default: copyPixels<0>(src, src_row_bytes, pixel_bytes, cols, rows, dst, step_x, step_y); break;
+				}
+			}
 
-		uint16_t num_ifds = 0;
-		f.read(num_ifds);
-		if( swap_bytes ) num_ifds = IFDEntry::swap16(num_ifds);
+			bool isIdentity() const {
+				return is_identity;
+			}
+		};
 
-		for (int i = 0; i < num_ifds; ++i) {
-			IFDEntry ifd;
-			f.read(ifd);
-			if( swap_bytes ) ifd.swap();
-			
-			fn( ifd.id, ifd.value, ifd.field_type, ifd.num_items );
+		// a * b / 255 rounded, for a and b in 0..255
+		static inline uint8_t mul255(uint32_t a, uint32_t b) {
+			uint32_t t = a * b + 128;
+			return (uint8_t)((t + (t >> 8)) >> 8);
 		}
 
-		return true;
-	}
-
-	#define tiff_printf	 if( 0 ) printf
+		// R = (1 - C) * (1 - K) and so on. Components of 16 bits use the upper 8 bits.
+		// The fifth component, when present, is the alpha
+		template< typename T >
+		static void cmykToRGB(const T* src, uint8_t* dst, size_t num_pixels, int num_components, int channels) {
+			const int shift = 8 * (sizeof(T) - 1);
+			for (size_t i = 0; i < num_pixels; ++i, src += num_components, dst += channels) {
+				uint32_t k = 255 - (src[3] >> shift);
+				dst[0] = mul255(255 - (src[0] >> shift), k);
+				dst[1] = mul255(255 - (src[1] >> shift), k);
+				dst[2] = mul255(255 - (src[2] >> shift), k);
+				if (channels == 4)
+					dst[3] = (num_components > 4) ? (uint8_t)(src[4] >> shift) : 255;
+			}
+		}
 
-	template< typename Fn, typename FnMeta = void>
-	static bool load(const char* ifilename, Fn fn) {
+		static inline uint8_t clamp255(int32_t v) {
+			return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+		}
 
-		using namespace internal;
+		// Tables in 16.16 fixed point to convert YCbCr to RGB, following section 21 of the tiff spec.
+		// coefficients are the luma of red, green and blue. reference the black/white of Y, Cb and Cr
+		struct YCbCrToRGB {
+			int32_t y_tab[256];
+			int32_t cr_r[256];
+			int32_t cb_b[256];
+			int32_t cr_g[256];
+			int32_t cb_g[256];
+
+			void init(const float* coefficients, const float* reference) {
+				float luma_red = coefficients[0];
+				float luma_green = coefficients[1] != 0.0f ? coefficients[1] : 1.0f;
+				float luma_blue = coefficients[2];
+				float range[3];
+				for (int c = 0; c < 3; ++c) {
+					range[c] = reference[2 * c + 1] - reference[2 * c];
+					if (range[c] == 0.0f)
+						range[c] = 1.0f;
+				}
+				const float one = 65536.0f;
+				for (int i = 0; i < 256; ++i) {
+					float y = (i - reference[0]) * 255.0f / range[0];
+					float cb = (i - reference[2]) * 127.0f / range[1];
+					float cr = (i - reference[4]) * 127.0f / range[2];
+					// The rounding of the final >> 16 goes into the luma
+					y_tab[i] = (int32_t)(y * one + 32768.0f);
+					cr_r[i] = (int32_t)(cr * (2.0f - 2.0f * luma_red) * one);
+					cb_b[i] = (int32_t)(cb * (2.0f - 2.0f * luma_blue) * one);
+					cr_g[i] = -(int32_t)(cr * luma_red * (2.0f - 2.0f * luma_red) / luma_green * one);
+					cb_g[i] = -(int32_t)(cb * luma_blue * (2.0f - 2.0f * luma_blue) / luma_green * one);
+				}
+			}
 
-		FileReader f;
-		if (!f.open(ifilename))
-			return false;
+			void toRGB(int y, int cb, int cr, uint8_t* dst) const {
+				int32_t yv = y_tab[y];
+				dst[0] = clamp255((yv + cr_r[cr]) >> 16);
+				dst[1] = clamp255((yv + cr_g[cr] + cb_g[cb]) >> 16);
+				dst[2] = clamp255((yv + cb_b[cb]) >> 16);
+			}
+		};
 
-		Header header;
-		f.read(header);
-		if (!header.isValid())
-			return false;
+	};
 
-		bool swap_bytes = header.mustSwapBytes();
-		if( swap_bytes ) header.offset_first_ifd = IFDEntry::swap32( header.offset_first_ifd );
-		f.seek(header.offset_first_ifd);
+	// Phases reported to the Instrumentation interface
+	enum class Phase {
+		Open,				// fopen of the file
+		Header,				// Read and validate the tiff header
+		IFD,				// Parse the IFD entries (bytes = size of the entries)
+		Seek,				// Each real fseek done by the reader
+		PixelRead,			// Reads done by the user callback
+		ByteSwap,			// Swap of the components of big endian files
+		Decompress,
+		Convert,
+		Write,				// Writing the file in save
+	};
 
-		tiff_printf("OffsetFirstIFD: %08x (%d). Swap:%d\n", header.offset_first_ifd , header.offset_first_ifd, swap_bytes );
+	// Optional instrumentation of load/info/save. The hooks are only compiled when
+	// MINI_TIFF_INSTRUMENTATION is defined, otherwise attaching one has no effect.
+	struct Instrumentation {
+		virtual ~Instrumentation() {}
+		virtual void onPhase(Phase phase, uint64_t nanoseconds, uint64_t bytes) = 0;
+	};
 
-		uint16_t num_ifds = 0;
-		f.read(num_ifds);
-		if( swap_bytes ) num_ifds = IFDEntry::swap16(num_ifds);
+	namespace internal {
+#ifdef MINI_TIFF_INSTRUMENTATION
+		static inline uint64_t nowNs() {
+			using namespace std::chrono;
+			return (uint64_t)duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+		}
+		#define MINI_TIFF_PHASE_BEGIN(t0)						uint64_t t0 = MiniTiff::internal::nowNs()
+		#define MINI_TIFF_PHASE_END(instr, phase, t0, bytes)	if( instr ) (instr)->onPhase(phase, MiniTiff::internal::nowNs() - t0, bytes)
+#else
+		#define MINI_TIFF_PHASE_BEGIN(t0)
+		#define MINI_TIFF_PHASE_END(instr, phase, t0, bytes)
+#endif
+	}
 
+	// Description of an image, as found in the first IFD of the file
+	struct ImageInfo {
+		bool     is_valid = false;
+		bool     big_endian = false;
 		int      w = 0;
 		int      h = 0;
 		int      num_components = 0;
 		int      bits_per_component = 0;
-		uint32_t offset_for_data = -1;
-		uint32_t total_data_bytes = 0;
-		bool     swap_component_data = false;
-			
-		for (int i = 0; i < num_ifds; ++i) {
-
-			IFDEntry ifd;
-			f.read(ifd);
-
-			if( swap_bytes ) ifd.swap();
+		uint32_t image_type = 0;
+		uint16_t sample_format = 1;			// 1:uint, 2:int, 3:float. See SampleFormat_xxx
+		uint16_t photometric = 0;			// 0:Grey (0 is white), 1:Grey, 2:RGB, 3:Palette
+		uint16_t compression = 1;			// 1:None
+		uint16_t planar_configuration = 1;	// 1:Interleaved
+		uint16_t orientation = 1;			// 1:Rows top to bottom, columns left to right. 5..8 are transposed
+		uint16_t fill_order = 0;			// 0 when the tag is not present
+		uint32_t rows_per_strip = ~0u;		// Default is a single strip
+		uint32_t num_strips = 0;			// Number of strips, or tiles
+		uint32_t offset_for_data = ~0u;		// The data of the first strip. With several strips, where their offsets are
+		uint32_t total_data_bytes = 0;		// Size of the first strip. With several strips, where their sizes are
+		uint32_t tile_w = 0;				// 0 when the image is stored in strips
+		uint32_t tile_h = 0;
+		uint32_t jpeg_tables_at = 0;
+		uint32_t jpeg_tables_size = 0;
+		uint32_t color_map_count = 0;		// 3 * 2^bits_per_component
+		uint16_t ink_set = 1;				// 1:CMYK, for photometric 5
+		uint16_t ycbcr_subsampling[2] = { 2, 2 };	// Horizontal and vertical, for photometric 6
+		uint32_t offset_first_ifd = 0;
+		uint32_t offset_next_ifd = 0;
+		uint32_t num_pages = 0;
+	};
 
-			tiff_printf("%04x:%04x:%04x:%08x %s: ", ifd.id, ifd.field_type, ifd.num_items, ifd.value, Tags::asStr( ifd.id ));
+	// Decoder of compressed strips or tiles. PackBits is built in, and JPEG when MINI_TIFF_JPEG is defined.
+	// Others can be added with TiffDecoder::addCodec
+	struct Codec {
+		virtual ~Codec() {}
+		// Value of IFD_Compression handled by the codec
+		virtual uint16_t compression() const = 0;
+		// Called once per image, before decoding the blocks. tables are the contents of IFD_JPEGTables, if any
+		virtual bool begin(const ImageInfo& info, const uint8_t* tables, size_t tables_size, int num_threads) {
+			return true;
+		}
+		// Decodes a strip or tile into num_rows of row_bytes each. Called from num_threads threads
+		// at once, each one with a different thread_index
+		virtual bool decode(const uint8_t* src, size_t src_size, uint8_t* dst, size_t row_bytes, int num_rows, int thread_index) = 0;
+		// Encodes num_rows of row_bytes each, replacing the contents of dst. Codecs which can only decode return false
+		virtual bool encode(const uint8_t* src, size_t row_bytes, int num_rows, std::vector< uint8_t >& dst) {
+			return false;
+		}
+	};
 
-			switch (ifd.id) {
+	namespace internal {
 
-			case IFD_ImageType:
-				if (ifd.value != 0)
-					return false;
-				break;
+		// Each control byte n copies the next n + 1 bytes (0..127) or repeats the next byte 1 - n times (-127..-1)
+		struct PackBitsCodec : Codec {
+			uint16_t compression() const override {
+				return Compression_PackBits;
+			}
+			bool decode(const uint8_t* src, size_t src_size, uint8_t* dst, size_t row_bytes, int num_rows, int thread_index) override {
+				const uint8_t* src_end = src + src_size;
+				size_t dst_size = row_bytes * num_rows;
+				size_t n = 0;
+				while (n < dst_size && src < src_end) {
+					int code = (int8_t)*src++;
+					if (code >= 0) {
+						size_t k = code + 1;
+						if (k > (size_t)(src_end - src) || n + k > dst_size)
+							return false;
+						memcpy(dst + n, src, k);
+						src += k;
+						n += k;
+					}
+					else if (code != -128) {
+						size_t k = 1 - code;
+						if (src == src_end || n + k > dst_size)
+							return false;
+						memset(dst + n, *src++, k);
+						n += k;
+					}
+				}
+				return n == dst_size;
+			}
+			// Runs of 3 or more equal bytes are repeated, the rest are copied. Runs don't cross rows
+			bool encode(const uint8_t* src, size_t row_bytes, int num_rows, std::vector< uint8_t >& dst) override {
+				dst.clear();
+				for (int y = 0; y < num_rows; ++y, src += row_bytes) {
+					size_t i = 0;
+					while (i < row_bytes) {
+						size_t run = 1;
+						while (i + run < row_bytes && run < 128 && src[i + run] == src[i])
+							++run;
+						if (run >= 3) {
+							dst.push_back((uint8_t)(1 - (int)run));
+							dst.push_back(src[i]);
+							i += run;
+							continue;
+						}
+						size_t n = 1;
+						while (i + n < row_bytes && n < 128 && !(i + n + 2 < row_bytes && src[i + n] == src[i + n + 1] && src[i + n] == src[i + n + 2]))
+							++n;
+						dst.push_back((uint8_t)(n - 1));
+						dst.insert(dst.end(), src + i, src + i + n);
+						i += n;
+					}
+				}
+				return true;
+			}
+		};
 
-			case IFD_Width:
-				tiff_printf("%d", ifd.value);
-				w = ifd.value;
-				break;
+#ifdef MINI_TIFF_JPEG
+		// libjpeg calls exit() on errors, so we jump back to the codec instead
+		struct JPEGDecompressor {
+			jpeg_decompress_struct cinfo;
+			jpeg_error_mgr         error_mgr;
+			jmp_buf                on_error;
+			static void onError(j_common_ptr cinfo) {
+				longjmp(((JPEGDecompressor*)cinfo->client_data)->on_error, 1);
+			}
+			static void onMessage(j_common_ptr cinfo) {
+			}
+			JPEGDecompressor() {
+				cinfo.err = jpeg_std_error(&error_mgr);
+				error_mgr.error_exit = &onError;
+				error_mgr.output_message = &onMessage;
+				jpeg_create_decompress(&cinfo);
+				cinfo.client_data = this;
+			}
+			~JPEGDecompressor() {
+				jpeg_destroy_decompress(&cinfo);
+			}
+		};
 
-			case IFD_Height:
-				tiff_printf("%d", ifd.value);
-				h = ifd.value;
-				break;
+		// Strips or tiles compressed as JPEG (compression 7). The JPEGTables shared by all the blocks
+		// are parsed once per image, and copied to the decompressor of each thread.
+		// YCbCr images are decoded as RGB
+		struct JPEGCodec : Codec {
+			std::vector< std::unique_ptr< JPEGDecompressor > > decompressors;
+			J_COLOR_SPACE color_space = JCS_UNKNOWN;
+			int num_components = 0;
 
-			case IFD_BitsPerSample:
-				tiff_printf("(At @0x%08x)", ifd.value);
-				bits_per_component = ifd.value;
-				break;
+			uint16_t compression() const override {
+				return Compression_JPEG;
+			}
 
-			case IFD_Compression:
-				tiff_printf("%d", ifd.value);
-				if (ifd.value != 1)
+			bool begin(const ImageInfo& info, const uint8_t* tables, size_t tables_size, int num_threads) override {
+				num_components = info.num_components;
+				if (info.bits_per_component != 8)
 					return false;
-				break;
-
-			case IFD_PhotometricInterpretation:
-				if (ifd.value != 2 && ifd.value != 1)
+				if (info.photometric == 6 && num_components == 3)
+					color_space = JCS_YCbCr;
+				else if (info.photometric == 2 && num_components == 3)
+					color_space = JCS_RGB;
+				else if (info.photometric <= 1 && num_components == 1)
+					color_space = JCS_GRAYSCALE;
+				else
 					return false;
-				break;
+				while (decompressors.size() < (size_t)num_threads)
+					decompressors.emplace_back(new JPEGDecompressor());
+				if (!tables_size)
+					return true;
 
-			case IFD_OffsetForData:
-				tiff_printf("(At @0x%08x)", ifd.value);
-				offset_for_data = ifd.value;
-				break;
+				// Load the tables in the first decompressor, and copy them to the others
+				JPEGDecompressor* first = decompressors[0].get();
+				if (setjmp(first->on_error)) {
+					jpeg_abort_decompress(&first->cinfo);
+					return false;
+				}
+				jpeg_mem_src(&first->cinfo, (unsigned char*)tables, (unsigned long)tables_size);
+				if (jpeg_read_header(&first->cinfo, FALSE) != JPEG_HEADER_TABLES_ONLY)
+					return false;
+				for (size_t i = 1; i < decompressors.size(); ++i) {
+					jpeg_decompress_struct& dst = decompressors[i]->cinfo;
+					if (setjmp(decompressors[i]->on_error))
+						return false;
+					for (int t = 0; t < NUM_QUANT_TBLS; ++t)
+						copyTable(dst, first->cinfo.quant_tbl_ptrs[t], dst.quant_tbl_ptrs[t]);
+					for (int t = 0; t < NUM_HUFF_TBLS; ++t) {
+						copyTable(dst, first->cinfo.dc_huff_tbl_ptrs[t], dst.dc_huff_tbl_ptrs[t]);
+						copyTable(dst, first->cinfo.ac_huff_tbl_ptrs[t], dst.ac_huff_tbl_ptrs[t]);
+					}
+				}
+				return true;
+			}
 
-			case IFD_NumComponents:
-				tiff_printf("%d", ifd.value);
-				num_components = ifd.value;
-				break;
+			static void copyTable(jpeg_decompress_struct& cinfo, const JQUANT_TBL* src, JQUANT_TBL*& dst) {
+				if (!src)
+					return;
+				if (!dst)
+					dst = jpeg_alloc_quant_table((j_common_ptr)&cinfo);
+				*dst = *src;
+			}
+			static void copyTable(jpeg_decompress_struct& cinfo, const JHUFF_TBL* src, JHUFF_TBL*& dst) {
+				if (!src)
+					return;
+				if (!dst)
+					dst = jpeg_alloc_huff_table((j_common_ptr)&cinfo);
+				*dst = *src;
+			}
 
-			case IFD_RowsPerStrip:
-				tiff_printf("%d (should be %d)", ifd.value, h);
-				if (ifd.value != h)
+			bool decode(const uint8_t* src, size_t src_size, uint8_t* dst, size_t row_bytes, int num_rows, int thread_index) override {
+				JPEGDecompressor* d = decompressors[thread_index].get();
+				jpeg_decompress_struct& cinfo = d->cinfo;
+				if (setjmp(d->on_error)) {
+					jpeg_abort_decompress(&cinfo);
+					return false;
+				}
+				jpeg_mem_src(&cinfo, (unsigned char*)src, (unsigned long)src_size);
+				if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+					jpeg_abort_decompress(&cinfo);
+					return false;
+				}
+				cinfo.jpeg_color_space = color_space;
+				cinfo.out_color_space = (color_space == JCS_YCbCr) ? JCS_RGB : color_space;
+				jpeg_start_decompress(&cinfo);
+				if (cinfo.output_components != num_components || (size_t)cinfo.output_width * num_components > row_bytes) {
+					jpeg_abort_decompress(&cinfo);
 					return false;
-				break;
+				}
+				// The last strip can be encoded with more rows than the image has
+				while (cinfo.output_scanline < cinfo.output_height && (int)cinfo.output_scanline < num_rows) {
+					JSAMPROW row = dst + cinfo.output_scanline * row_bytes;
+					jpeg_read_scanlines(&cinfo, &row, 1);
+				}
+				bool is_complete = (int)cinfo.output_scanline >= num_rows;
+				if (cinfo.output_scanline < cinfo.output_height)
+					jpeg_abort_decompress(&cinfo);
+				else
+					jpeg_finish_decompress(&cinfo);
+				return is_complete;
+			}
+		};
+#endif
+	}
 
-			case IFD_TotalBytesForData:
-				tiff_printf("%d", ifd.value);
-				total_data_bytes = ifd.value;
-				break;
+	// A contiguous block of bytes to be written by FileWriter::writeSpans
+	struct Span {
+		const void* data = nullptr;
+		size_t      size = 0;
+	};
 
-			case IFD_PlanarConfiguration:
-				if (ifd.value != 1)
+	struct FileWriter {
+		FILE* f = nullptr;
+		size_t bytes_written = 0;
+		~FileWriter() {
+			if (f)
+				fclose(f);
+		}
+		bool create(const char* ofilename) {
+			f = fopen(ofilename, "wb");
+			return f != nullptr;
+		}
+		void writeBytes(const void* data, size_t num_bytes) {
+			fwrite(data, 1, num_bytes, f);
+			bytes_written += num_bytes;
+		}
+		template< typename T >
+		void write(T t) {
+			writeBytes(&t, sizeof(T));
+		}
+		// Overwrites bytes already written, to patch offsets once they are known. Next writes go to the end
+		bool writeAt(size_t offset, const void* data, size_t num_bytes) {
+			if (fseek(f, (long)offset, SEEK_SET) != 0)
+				return false;
+			bool is_ok = fwrite(data, 1, num_bytes, f) == num_bytes;
+			return fseek(f, 0, SEEK_END) == 0 && is_ok;
+		}
+		// Writes all the spans in order. In posix systems this is a single writev call
+		bool writeSpans(Span* spans, int num_spans) {
+#ifdef _WIN32
+			for (int i = 0; i < num_spans; ++i) {
+				if (fwrite(spans[i].data, 1, spans[i].size, f) != spans[i].size)
 					return false;
-				break;
+				bytes_written += spans[i].size;
+			}
+			return true;
+#else
+			static constexpr int max_spans = 16;
+			if (num_spans > max_spans)
+				return false;
+			struct iovec iov[max_spans];
+			for (int i = 0; i < num_spans; ++i) {
+				iov[i].iov_base = (void*)spans[i].data;
+				iov[i].iov_len = spans[i].size;
+			}
+			// Anything already buffered by stdio must reach the file before
+			fflush(f);
+			int fd = fileno(f);
+			struct iovec* p = iov;
+			int n = num_spans;
+			while (n > 0) {
+				ssize_t rc = writev(fd, p, n);
+				if (rc < 0) {
+					if (errno == EINTR)
+						continue;
+					return false;
+				}
+				bytes_written += rc;
+				// Partial write. Skip the spans fully written and retry with the rest
+				size_t done = (size_t)rc;
+				while (n > 0 && done >= p->iov_len) {
+					done -= p->iov_len;
+					++p;
+					--n;
+				}
+				if (n > 0) {
+					p->iov_base = (uint8_t*)p->iov_base + done;
+					p->iov_len -= done;
+				}
+			}
+			return true;
+#endif
+		}
+	};
 
-			case IFD_SampleFormat:
-				tiff_printf("%d", ifd.value);
-				break;
+	#ifndef MINI_TIFF_PREFETCH_SIZE
+	#define MINI_TIFF_PREFETCH_SIZE 4096
+	#endif
 
-			case IFD_FillOrder:
-				tiff_printf("%d", ifd.value);
-				swap_component_data = (ifd.value == 1);
-				break;
-					
-			// Ignored
-			case IFD_ICCProfile:
-				break;
+	#ifndef MINI_TIFF_MAX_IFD_ENTRIES
+	#define MINI_TIFF_MAX_IFD_ENTRIES 256
+	#endif
 
-			case IFD_ExtraSamples:
-				break;
-			case IFD_Exif:
-				break;
-			case IFD_XMLPacket:
-				break;
-			case IFD_Photoshop:
-				break;
-			case IFD_DateTime:
-				break;
-			case IFD_Software:
-				break;
-			case IFD_XResolution:			// Typically 72 inch
-			case IFD_YResolution:
-			case IFD_ResolutionUnits:		// Typically inch
-				break;
-			case IFD_Orientation:
-				break;
-			default:
-				break;
-			}
+	#ifndef MINI_TIFF_IFD_DATA_SIZE
+	#define MINI_TIFF_IFD_DATA_SIZE 4096
+	#endif
 
-			tiff_printf("\n");
-		}
+	// Most bytes of values read with an IFD. Longer arrays are left in the file, see FileReader::readBlob
+	#ifndef MINI_TIFF_IFD_MAX_DATA_SIZE
+	#define MINI_TIFF_IFD_MAX_DATA_SIZE (1 << 20)
+	#endif
 
-		if (w == 0 || h == 0 || total_data_bytes == 0 || offset_for_data == -1) {
-			tiff_printf( "Didn't read needed data: w:%d h:%d total_data_bytes:%d offset_for_data:%d\n", w, h, total_data_bytes, offset_for_data);
-			return false;
+	namespace internal {
+		// Bytes of each value of a field type, 0 for unknown types
+		static uint32_t fieldTypeBytes(uint16_t type) {
+			switch (type) {
+			case 1: case 2: case 6: case 7: return 1;
+			case 3: case 8: return 2;
+			case 4: case 9: case 11: case 13: return 4;
+			case 5: case 10: case 12: return 8;
+			}
+			return 0;
 		}
+	}
 
-		// This can be 8,16 ore 32, or an offset in the file to get the bits_per_each_component
-		// Here I assume all the components have the same number of bits
-		if (bits_per_component != 8 && bits_per_component != 16 && bits_per_component != 32) {
-			// Interpret the value as offset in the file
-			f.seek(bits_per_component);
-			uint16_t us_bpc;
-			f.read(us_bpc);
-			bits_per_component = us_bpc;
-			if( swap_bytes ) bits_per_component = IFDEntry::swap16(bits_per_component);
-			if (bits_per_component != 8 && bits_per_component != 16 && bits_per_component != 32) {
-				tiff_printf( "Invalid bits per component: %d (%08x)\n", bits_per_component, bits_per_component);
+	// The entries of an IFD with their values. Arrays of shorts, ints, rationals, text and doubles stored out
+	// of the entries are read while parsing, in native byte order, and the accessors give pointers to them
+	// without copies. Bytes and undefined blobs (ICC, XMP, JPEGTables...) are left in the file, see offset,
+	// and so are the offsets and sizes of the strips and tiles, see FileReader::getBlocks.
+	// Values are only allocated when they don't fit in MINI_TIFF_IFD_DATA_SIZE. Arrays are read up to
+	// MINI_TIFF_IFD_MAX_DATA_SIZE bytes in total, the ones not fitting are left in the file too
+	struct IFD {
+		struct Entry {
+			uint16_t id;
+			uint16_t type;
+			uint32_t count;
+			uint32_t value;			// The value when it's inline, or the offset of the values in the file
+			uint32_t data_at;		// Where the values are in data, ~0u when they were not read
+		};
+		static constexpr uint32_t max_entries = MINI_TIFF_MAX_IFD_ENTRIES;
+		static constexpr uint32_t max_array_bytes = MINI_TIFF_IFD_MAX_DATA_SIZE;	// Of all the arrays read
+		Entry    entries[max_entries];
+		uint32_t num_entries = 0;			// Entries after max_entries are ignored
+
+		void clear() {
+			num_entries = 0;
+			data_size = 0;
+			large_data.clear();
+		}
+		const Entry* find(uint16_t id) const {
+			for (uint32_t i = 0; i < num_entries; ++i)
+				if (entries[i].id == id)
+					return &entries[i];
+			return nullptr;
+		}
+		uint32_t count(uint16_t id) const {
+			const Entry* e = find(id);
+			return e ? e->count : 0;
+		}
+		// Offset in the file of the values of id, for the blobs which are not read
+		uint32_t offset(uint16_t id) const {
+			const Entry* e = find(id);
+			return (e && e->count * internal::fieldTypeBytes(e->type) > 4) ? e->value : 0;
+		}
+		// Value index of a byte, short or int tag, or default_value if it's missing
+		uint32_t get(uint16_t id, uint32_t default_value = 0, uint32_t index = 0) const {
+			const Entry* e = find(id);
+			if (!e || index >= e->count || e->data_at == ~0u)
+				return default_value;
+			const uint8_t* p = data() + e->data_at;
+			switch (e->type) {
+			case 1: return p[index];
+			case 3: return ((const uint16_t*)p)[index];
+			case 4: case 13: return ((const uint32_t*)p)[index];
+			}
+			return default_value;
+		}
+		// All the values of a short or int tag as ints, like the offsets of the strips
+		bool get(uint16_t id, std::vector< uint32_t >& values) const {
+			const Entry* e = find(id);
+			if (!e || e->data_at == ~0u || (e->type != 3 && e->type != 4))
+				return false;
+			values.resize(e->count);
+			for (uint32_t i = 0; i < e->count; ++i)
+				values[i] = get(id, 0, i);
+			return true;
+		}
+		const uint16_t* shorts(uint16_t id, uint32_t* num_values = nullptr) const {
+			return values< uint16_t >(id, 3, num_values);
+		}
+		const uint32_t* ints(uint16_t id, uint32_t* num_values = nullptr) const {
+			return values< uint32_t >(id, 4, num_values);
+		}
+		const double* doubles(uint16_t id, uint32_t* num_values = nullptr) const {
+			return values< double >(id, 12, num_values);
+		}
+		// Numerator and denominator of each rational
+		const uint32_t* rationals(uint16_t id, uint32_t* num_values = nullptr) const {
+			return values< uint32_t >(id, 5, num_values);
+		}
+		// Up to num_values rationals as floats. Returns false if the tag is missing or is shorter
+		bool rationals(uint16_t id, float* dst, uint32_t num_values) const {
+			uint32_t n = 0;
+			const uint32_t* fractions = rationals(id, &n);
+			if (!fractions || n < num_values)
 				return false;
+			for (uint32_t i = 0; i < num_values; ++i)
+				dst[i] = fractions[2 * i + 1] ? (float)fractions[2 * i] / (float)fractions[2 * i + 1] : 0.0f;
+			return true;
+		}
+		// Always null terminated, nullptr if the tag is missing
+		const char* text(uint16_t id) const {
+			return (const char*)values< uint8_t >(id, 2, nullptr);
+		}
+
+		// Storage for the values of the entries, aligned to 8 bytes. Returns its offset in data
+		uint32_t reserve(uint32_t num_bytes) {
+			uint32_t at = data_size;
+			data_size += (num_bytes + 7) & ~7u;
+			if (data_size > sizeof(small_data)) {
+				if (large_data.empty())
+					large_data.assign(small_data, small_data + at);
+				large_data.resize(data_size);
 			}
+			return at;
 		}
+		uint8_t* data() {
+			return large_data.empty() ? small_data : large_data.data();
+		}
+		const uint8_t* data() const {
+			return large_data.empty() ? small_data : large_data.data();
+		}
+
+	private:
+		alignas(8) uint8_t small_data[MINI_TIFF_IFD_DATA_SIZE];
+		std::vector< uint8_t > large_data;
+		uint32_t data_size = 0;
+
+		template< typename T >
+		const T* values(uint16_t id, uint16_t type, uint32_t* num_values) const {
+			const Entry* e = find(id);
+			if (!e || e->type != type || e->data_at == ~0u)
+				return nullptr;
+			if (num_values)
+				*num_values = e->count;
+			return (const T*)(data() + e->data_at);
+		}
+	};
+
+	// Photo metadata of the Exif and GPS sub-IFDs, see FileReader::readExif. Missing fields are 0
+	struct ExifInfo {
+		bool     has_exif = false;
+		bool     has_gps = false;
+		float    exposure_time = 0.0f;			// Seconds
+		float    f_number = 0.0f;
+		float    focal_length = 0.0f;			// Millimeters
+		uint32_t iso = 0;
+		char     date_time_original[20] = {};	// "YYYY:MM:DD HH:MM:SS", when the photo was taken
+		double   latitude = 0.0;				// Degrees, negative to the south
+		double   longitude = 0.0;				// Degrees, negative to the west
+		double   altitude = 0.0;				// Meters, negative below the sea level
+	};
 
-		f.seek(offset_for_data);
-		tiff_printf( "Read needed data: w:%d h:%d bits_per_component:%d total_data_bytes:%d offset_for_data:%d\n", w, h, bits_per_component, total_data_bytes, offset_for_data);
+	namespace internal {
+		// Threads kept between the calls to run, so decoding each image doesn't start new ones.
+		// run must not be called from several threads at once
+		struct WorkerPool {
+			~WorkerPool() {
+				{
+					std::lock_guard< std::mutex > lock(mutex);
+					quit = true;
+				}
+				wake.notify_all();
+				for (auto& t : threads)
+					t.join();
+			}
 
-		// Configure the reader to swap the bytes of each component so the user does not have to deal with it
-		if( swap_component_data && bits_per_component == 16 )
-			f.swap_16b_data = true;
-		if( swap_component_data && bits_per_component == 32 )
-			f.swap_32b_data = true;
+			// Calls fn(thread_index) from num_threads threads, the calling one being the 0, and waits for all of them
+			void run(int num_threads, const std::function< void(int) >& fn) {
+				std::unique_lock< std::mutex > lock(mutex);
+				while ((int)threads.size() < num_threads - 1) {
+					int index = (int)threads.size() + 1;
+					uint64_t started_at = generation;
+					threads.emplace_back([this, index, started_at]() { work(index, started_at); });
+				}
+				job = &fn;
+				job_threads = num_threads;
+				num_active = num_threads - 1;
+				++generation;
+				lock.unlock();
+				wake.notify_all();
+				fn(0);
+				lock.lock();
+				done.wait(lock, [&]() { return num_active == 0; });
+				job = nullptr;
+			}
 
-		return fn(w, h, num_components, bits_per_component, f);
+		private:
+			std::vector< std::thread > threads;
+			std::mutex mutex;
+			std::condition_variable wake;
+			std::condition_variable done;
+			const std::function< void(int) >* job = nullptr;
+			int      job_threads = 0;
+			int      num_active = 0;
+			uint64_t generation = 0;
+			bool     quit = false;
+
+			void work(int index, uint64_t seen) {
+				std::unique_lock< std::mutex > lock(mutex);
+				for (;;) {
+					wake.wait(lock, [&]() { return quit || generation != seen; });
+					if (quit)
+						return;
+					seen = generation;
+					if (index >= job_threads)
+						continue;
+					const std::function< void(int) >* fn = job;
+					lock.unlock();
+					(*fn)(index);
+					lock.lock();
+					if (--num_active == 0)
+						done.notify_one();
+				}
+			}
+		};
 	}
 
+	struct FileReader {
+		FILE* f = nullptr;
+		size_t bytes_read = 0;
+		bool   swap_16b_data = false;
+		bool   swap_32b_data = false;
+		bool   swap_64b_data = false;
+
+		// A block of the file read with a single call, used to parse the header and IFDs from memory
+		static constexpr uint32_t prefetch_capacity = MINI_TIFF_PREFETCH_SIZE;
+		uint8_t  prefetch_data[prefetch_capacity];
+		uint32_t prefetch_offset = 0;		// File offset of prefetch_data[0]
+		uint32_t prefetch_size = 0;			// Valid bytes in prefetch_data
+		uint32_t position = 0;				// Where the next readBytes will read from
+		uint32_t file_position = 0;			// Where f is really positioned
+		uint64_t file_size = 0;				// 0 until fileSize is called
+
+		Instrumentation* instrumentation = nullptr;
+		bool     reading_pixels = false;		// Reads are reported as Phase::PixelRead
+		bool     must_decode = false;			// The pixels are not a single block in the file
+		bool     apply_orientation = false;		// readImage gives the image oriented as IFD_Orientation says
+		Codec*   codec = nullptr;				// Decoder of the compressed strips/tiles of the image
+
+		ImageInfo info;						// The image being loaded, valid in the load callback
+		IFD       ifd;						// All the tags of the image, also valid in the load callback
+
+		// Threads and buffers of forEachBlock, kept for the next images
+		internal::WorkerPool workers;
+		std::vector< std::vector< uint8_t > > block_buffers;
+
+		~FileReader() {
+			close();
+		}
+		// The reader can be reused for several files, the prefetch block is kept
+		bool open(const char* ofilename) {
+			close();
+			f = fopen(ofilename, "rb");
+			return f != nullptr;
+		}
+		void close() {
+			if (f)
+				fclose(f);
+			f = nullptr;
+			bytes_read = 0;
+			swap_16b_data = false;
+			swap_32b_data = false;
+			swap_64b_data = false;
+			reading_pixels = false;
+			must_decode = false;
+			apply_orientation = false;
+			codec = nullptr;
+			info = ImageInfo();
+			ifd.clear();
+			prefetch_offset = 0;
+			prefetch_size = 0;
+			position = 0;
+			file_position = 0;
+			file_size = 0;
+		}
+		// Makes sure the range is in the prefetch block, reading a new block starting at offset if required
+		bool prefetch(uint32_t offset, uint32_t num_bytes) {
+			if (offset >= prefetch_offset && (uint64_t)offset + num_bytes <= (uint64_t)prefetch_offset + prefetch_size)
+				return true;
+			if (file_position != offset && !seekFile(offset))
+				return false;
+			prefetch_offset = offset;
+			prefetch_size = (uint32_t)fread(prefetch_data, 1, prefetch_capacity, f);
+			file_position = offset + prefetch_size;
+			return num_bytes <= prefetch_size;
+		}
+		// Known without asking the system when the prefetch block reached the end of the file
+		uint64_t fileSize() {
+			if (file_size == 0 && f) {
+				if (prefetch_size > 0 && prefetch_size < prefetch_capacity)
+					file_size = (uint64_t)prefetch_offset + prefetch_size;
+				else {
+#ifdef _WIN32
+					struct _stat64 st;
+					if (_fstat64(_fileno(f), &st) == 0)
+						file_size = (uint64_t)st.st_size;
+#else
+					struct stat st;
+					if (fstat(fileno(f), &st) == 0)
+						file_size = (uint64_t)st.st_size;
+#endif
+				}
+			}
+			return file_size;
+		}
+		bool seekFile(uint32_t offset) {
+			MINI_TIFF_PHASE_BEGIN(t0);
+			bool is_ok = fseek(f, offset, SEEK_SET) == 0;
+			MINI_TIFF_PHASE_END(instrumentation, Phase::Seek, t0, 0);
+			return is_ok;
+		}
+		bool readBytes(void* data, size_t num_bytes) {
+			// The pixels of compressed, tiled or multi strip images are only available with readImage
+			if (must_decode)
+				return false;
+			MINI_TIFF_PHASE_BEGIN(t0);
+			uint8_t* dst = (uint8_t*)data;
+			size_t n = 0;
+
+			// Serve what we can from the prefetch block
+			if (position >= prefetch_offset && position < prefetch_offset + prefetch_size) {
+				n = prefetch_offset + prefetch_size - position;
+				if (n > num_bytes)
+					n = num_bytes;
+				memcpy(dst, prefetch_data + (position - prefetch_offset), n);
+				position += (uint32_t)n;
+			}
+
+			// And the rest from the file
+			if (n < num_bytes) {
+				if (file_position != position)
+					seekFile(position);
+				size_t nread = fread(dst + n, 1, num_bytes - n, f);
+				n += nread;
+				position += (uint32_t)nread;
+				file_position = position;
+			}
+			bytes_read += num_bytes;
+			if (reading_pixels) {
+				MINI_TIFF_PHASE_END(instrumentation, Phase::PixelRead, t0, n);
+			}
+
+			// Swap component data inside the lib
+			if (swap_16b_data || swap_32b_data || swap_64b_data) {
+				MINI_TIFF_PHASE_BEGIN(t1);
+				internal::swapComponents(data, num_bytes, swap_16b_data ? 2 : (swap_32b_data ? 4 : 8));
+				MINI_TIFF_PHASE_END(instrumentation, Phase::ByteSwap, t1, n);
+			}
+
+			return n == num_bytes;
+		}
+		template< typename T >
+		bool read(T& t) {
+			return readBytes(&t, sizeof(T));
+		}
+		// The real seek is deferred until we need to read outside the prefetch block
+		void seek(uint32_t offset) {
+			position = offset;
+		}
+		// Position at the pixels of the image, and configure the reader to swap the bytes
+		// of each component so the user does not have to deal with it
+		void beginPixels(const ImageInfo& new_info) {
+			info = new_info;
+			seek(info.offset_for_data);
+			swap_16b_data = info.big_endian && info.bits_per_component == 16;
+			swap_32b_data = info.big_endian && info.bits_per_component == 32;
+			swap_64b_data = info.big_endian && info.bits_per_component == 64;
+			reading_pixels = true;
+			must_decode = info.compression != Compression_None || info.tile_w != 0 || info.num_strips > 1;
+			if (apply_orientation && info.orientation >= 2 && info.orientation <= 8)
+				must_decode = true;
+		}
+		// Reads num_values 16 bits floats converting them to 32 bits floats. Compressed, tiled or multi
+		// strip images must be read at once, with num_values the values of all the image
+		bool readHalfAsFloat(float* dst, size_t num_values) {
+			if (must_decode) {
+				if (num_values != (size_t)info.w * info.h * info.num_components)
+					return false;
+				return readRows([&](const uint8_t* src, size_t first_value, size_t n) {
+					internal::halfsToFloats((const uint16_t*)src, dst + first_value, n);
+					});
+			}
+			// The halfs are read in the second half of dst, then expanded in place
+			uint16_t* src = (uint16_t*)(dst + num_values) - num_values;
+			if (!readBytes(src, num_values * sizeof(uint16_t)))
+				return false;
+			MINI_TIFF_PHASE_BEGIN(t_convert);
+			internal::halfsToFloats(src, dst, num_values);
+			MINI_TIFF_PHASE_END(instrumentation, Phase::Convert, t_convert, num_values * sizeof(float));
+			return true;
+		}
+		// Reads all the image with the components of 1, 2 or 4 bits unpacked to one byte each.
+		// Values are not scaled, so 1 bit images will have 0 and 1 values. 8 bits images are just read.
+		bool readUnpacked(uint8_t* dst) {
+			if (info.bits_per_component == 8)
+				return readImage(dst);
+			if (!internal::isPacked(info.bits_per_component) || info.bits_per_component > 8)
+				return false;
+			return readRows([&](const uint8_t* src, size_t first_value, size_t n) {
+				internal::unpackBits(src, dst + first_value, n, info.bits_per_component);
+				});
+		}
+
+		// Reads all the image with the components of 12 bits unpacked to an uint16 each. 16 bits images are just read.
+		bool readUnpacked(uint16_t* dst) {
+			if (info.bits_per_component == 16)
+				return readImage(dst);
+			if (info.bits_per_component != 12)
+				return false;
+			return readRows([&](const uint8_t* src, size_t first_value, size_t n) {
+				internal::unpack12(src, dst + first_value, n);
+				});
+		}
+
+		// Reads the indices of a palette image (photometric 3) and gives the RGB or RGBA colors of the
+		// color map. Colors are 8 bits (uint8_t) or 16 bits (uint16_t). Alpha is always opaque.
+		template< typename T >
+		bool readPaletteRGB(T* dst, bool with_alpha = false) {
+			static_assert(sizeof(T) == 1 || sizeof(T) == 2, "Palette colors are uint8_t or uint16_t");
+			int bits = info.bits_per_component;
+			if (info.photometric != 3 || info.num_components != 1 || bits > 8 || info.color_map_count != 3u << bits)
+				return false;
+
+			// The color map was read with the IFD
+			const uint16_t* color_map = ifd.shorts(IFD_ColorMap);
+			if (!color_map)
+				return false;
+
+			// Colors of each index, with the channels of one pixel together
+			int channels = with_alpha ? 4 : 3;
+			int num_colors = 1 << bits;
+			T lut[256][4];
+			for (int i = 0; i < num_colors; ++i) {
+				for (int c = 0; c < 3; ++c)
+					lut[i][c] = (T)(color_map[c * num_colors + i] >> (16 - 8 * sizeof(T)));
+				lut[i][3] = (T)~0;
+			}
+
+			// There is no SIMD path: a lookup in a table of 256 colors is a gather, which SSE and NEON don't
+			// have and AVX2 does no faster than scalar loads. Each fixed size memcpy is a single load and
+			// store, and the reads from the file dominate anyway
+			return readRows([&](const uint8_t* src, size_t first_value, size_t n) {
+				T* out = dst + first_value * channels;
+				uint8_t indices[4096];
+				while (n > 0) {
+					size_t k = n < sizeof(indices) ? n : sizeof(indices);
+					const uint8_t* idx = src;
+					if (bits < 8) {
+						internal::unpackBits(src, indices, k, bits);
+						idx = indices;
+					}
+					if (with_alpha) {
+						for (size_t i = 0; i < k; ++i, out += 4)
+							memcpy(out, lut[idx[i]], 4 * sizeof(T));
+					}
+					else {
+						for (size_t i = 0; i < k; ++i, out += 3)
+							memcpy(out, lut[idx[i]], 3 * sizeof(T));
+					}
+					src += k * bits / 8;
+					n -= k;
+				}
+				});
+		}
+
+		// Layout of the strips or tiles of the image, see getBlocks
+		struct Blocks {
+			bool     is_tiled = false;
+			bool     is_single_strip = false;		// Uncompressed single strips are read in blocks of rows
+			uint32_t block_w = 0;
+			uint32_t block_h = 0;
+			size_t   blocks_across = 0;
+			size_t   num_blocks = 0;
+			size_t   row_bytes = 0;				// Of the image
+			size_t   block_row_bytes = 0;
+			std::vector< uint32_t > offsets;
+			std::vector< uint32_t > sizes;
+			std::vector< uint8_t >  tables;		// IFD_JPEGTables, if any
+			std::vector< uint32_t > selected;	// When not empty, forEachBlock only reads these blocks
+		};
+
+		bool getBlocks(Blocks& blocks) {
+			blocks.row_bytes = ((size_t)info.w * info.num_components * info.bits_per_component + 7) / 8;
+			if (info.compression != Compression_None && (!codec || codec->compression() != info.compression))
+				return false;
+			blocks.is_tiled = info.tile_w != 0;
+			blocks.is_single_strip = !blocks.is_tiled && info.compression == Compression_None && info.num_strips <= 1;
+			uint32_t rows_per_strip = info.rows_per_strip < (uint32_t)info.h ? info.rows_per_strip : (uint32_t)info.h;
+			if (blocks.is_single_strip)
+				rows_per_strip = (uint32_t)(blocks.row_bytes < (256 << 10) ? (256 << 10) / blocks.row_bytes : 1);
+			blocks.block_w = blocks.is_tiled ? info.tile_w : (uint32_t)info.w;
+			blocks.block_h = blocks.is_tiled ? info.tile_h : rows_per_strip;
+			if (blocks.block_w == 0 || blocks.block_h == 0)
+				return false;
+			if (blocks.is_tiled && info.bits_per_component % 8)
+				return false;
+			blocks.blocks_across = (info.w + blocks.block_w - 1) / blocks.block_w;
+			blocks.num_blocks = blocks.blocks_across * ((info.h + blocks.block_h - 1) / blocks.block_h);
+			blocks.block_row_bytes = blocks.is_tiled ? blocks.block_w * (info.num_components * info.bits_per_component / 8) : blocks.row_bytes;
+
+			// The tables are read as they are in the file
+			RawReads raw(*this);
+			bool is_ok = true;
+			blocks.offsets.clear();
+			if (blocks.is_single_strip) {
+				for (size_t i = 0; i < blocks.num_blocks; ++i)
+					blocks.offsets.push_back((uint32_t)(info.offset_for_data + i * blocks.block_h * blocks.row_bytes));
+			}
+			else {
+				is_ok = readBlockTable(blocks.is_tiled ? IFD_TileOffsets : IFD_OffsetForData, blocks.offsets)
+					&& readBlockTable(blocks.is_tiled ? IFD_TileByteCounts : IFD_TotalBytesForData, blocks.sizes)
+					&& blocks.offsets.size() >= blocks.num_blocks && blocks.sizes.size() >= blocks.num_blocks;
+			}
+			blocks.tables.resize(info.jpeg_tables_size);
+			if (is_ok && info.jpeg_tables_size) {
+				seek(info.jpeg_tables_at);
+				is_ok = readBytes(blocks.tables.data(), blocks.tables.size());
+			}
+			return is_ok;
+		}
+
+		// Offsets or sizes of the strips or tiles, as ints in native byte order. Unless they fit in the entry,
+		// they are not read with the IFD but here, so probe and scan never read them. Needs a RawReads alive
+		bool readBlockTable(uint16_t id, std::vector< uint32_t >& values) {
+			const IFD::Entry* e = ifd.find(id);
+			if (!e || (e->type != 3 && e->type != 4))
+				return false;
+			if (e->data_at != ~0u)
+				return ifd.get(id, values);
+			uint32_t type_bytes = internal::fieldTypeBytes(e->type);
+			if ((uint64_t)e->value + (uint64_t)e->count * type_bytes > fileSize())
+				return false;
+			values.resize(e->count);
+			seek(e->value);
+			if (e->type == 4) {
+				if (!readBytes(values.data(), e->count * 4))
+					return false;
+				if (info.big_endian)
+					internal::swapComponents(values.data(), e->count * 4, 4);
+				return true;
+			}
+			std::vector< uint16_t > shorts(e->count);
+			if (!readBytes(shorts.data(), e->count * 2))
+				return false;
+			if (info.big_endian)
+				internal::swapComponents(shorts.data(), e->count * 2, 2);
+			for (uint32_t i = 0; i < e->count; ++i)
+				values[i] = shorts[i];
+			return true;
+		}
+
+		// While alive, reads give the bytes as they are in the file. The position of the pixels is restored at the end
+		struct RawReads {
+			FileReader& f;
+			uint32_t position;
+			bool     must_decode;
+			bool     swaps[3];
+			RawReads(FileReader& new_f) : f(new_f), position(f.position), must_decode(f.must_decode), swaps{ f.swap_16b_data, f.swap_32b_data, f.swap_64b_data } {
+				f.must_decode = false;
+				f.swap_16b_data = f.swap_32b_data = f.swap_64b_data = false;
+			}
+			~RawReads() {
+				f.swap_16b_data = swaps[0];
+				f.swap_32b_data = swaps[1];
+				f.swap_64b_data = swaps[2];
+				f.must_decode = must_decode;
+				f.seek(position);
+			}
+		};
+
+		// Bytes of a blob of the image, like IFD_ICCProfile, IFD_XMLPacket or IFD_Photoshop, or of the
+		// values of any other tag. 0 if it's missing
+		size_t blobSize(uint16_t id) const {
+			const IFD::Entry* e = ifd.find(id);
+			if (!e)
+				return 0;
+			return (size_t)internal::fieldTypeBytes(e->type) * e->count;
+		}
+
+		// Copies the blob into dst, which must have blobSize(id) bytes. Blobs are not read with the IFD, so
+		// only the callers asking for them pay the read, or just a copy when it's in the prefetch block.
+		// Also gives the arrays too long to be read with the IFD, in native byte order.
+		// The position of the pixels is kept
+		bool readBlob(uint16_t id, void* dst) {
+			const IFD::Entry* e = ifd.find(id);
+			size_t num_bytes = blobSize(id);
+			if (num_bytes == 0)
+				return false;
+			if (e->data_at != ~0u) {
+				memcpy(dst, ifd.data() + e->data_at, num_bytes);
+				return true;
+			}
+			RawReads raw(*this);
+			seek(e->value);
+			if (!readBytes(dst, num_bytes))
+				return false;
+			uint32_t type_bytes = internal::fieldTypeBytes(e->type);
+			if (info.big_endian && type_bytes > 1)
+				internal::swapComponents(dst, num_bytes, (e->type == 5 || e->type == 10) ? 4 : type_bytes);
+			return true;
+		}
+
+		bool readBlob(uint16_t id, std::vector< uint8_t >& dst) {
+			// The size is checked before allocating it, the count can be anything
+			const IFD::Entry* e = ifd.find(id);
+			size_t num_bytes = blobSize(id);
+			if (e && e->data_at == ~0u && (uint64_t)e->value + num_bytes > fileSize()) {
+				dst.clear();
+				return false;
+			}
+			dst.resize(num_bytes);
+			return readBlob(id, dst.data());
+		}
+
+		// Follows the Exif and GPS sub-IFDs of the image. Their entries are read from the prefetch block,
+		// which usually has them when they are near the IFD. Nothing is allocated.
+		// Returns false if the image has none of them. The position of the pixels is kept
+		bool readExif(ExifInfo& exif) {
+			exif = ExifInfo();
+			RawReads raw(*this);
+			exif.has_exif = readSubIFD(ifd.get(IFD_Exif), [&](const internal::IFDEntry& e) {
+				switch (e.id) {
+				case 0x829A: exif.exposure_time = (float)readRational(e, 0); break;
+				case 0x829D: exif.f_number = (float)readRational(e, 0); break;
+				case 0x920A: exif.focal_length = (float)readRational(e, 0); break;
+				case 0x8827: exif.iso = (e.field_type == 3) ? (e.value & 0xffff) : e.value; break;	// PhotographicSensitivity
+				case 0x9003:																	// DateTimeOriginal
+					if (e.field_type == 2 && e.num_items > 4) {
+						seek(e.value);
+						readBytes(exif.date_time_original, e.num_items < sizeof(exif.date_time_original) ? e.num_items : sizeof(exif.date_time_original) - 1);
+					}
+					break;
+				}
+				});
+
+			// References are one letter, or a byte for the altitude, always inline
+			char latitude_ref = 'N';
+			char longitude_ref = 'E';
+			uint8_t altitude_ref = 0;
+			exif.has_gps = readSubIFD(ifd.get(IFD_GPS), [&](const internal::IFDEntry& e) {
+				switch (e.id) {
+				case 1: latitude_ref = (char)(e.value & 0xff); break;
+				case 2: exif.latitude = readDegrees(e); break;
+				case 3: longitude_ref = (char)(e.value & 0xff); break;
+				case 4: exif.longitude = readDegrees(e); break;
+				case 5: altitude_ref = (uint8_t)(e.value & 0xff); break;
+				case 6: exif.altitude = readRational(e, 0); break;
+				}
+				});
+			if (latitude_ref == 'S')
+				exif.latitude = -exif.latitude;
+			if (longitude_ref == 'W')
+				exif.longitude = -exif.longitude;
+			if (altitude_ref == 1)
+				exif.altitude = -exif.altitude;
+			return exif.has_exif || exif.has_gps;
+		}
+
+		// Calls fn(entry) for each entry of the IFD at offset, with the entry in native byte order
+		template< typename Fn >
+		bool readSubIFD(uint32_t offset, Fn fn) {
+			uint16_t num_entries = 0;
+			if (offset == 0 || !prefetch(offset, sizeof(uint16_t)))
+				return false;
+			seek(offset);
+			if (!read(num_entries))
+				return false;
+			if (info.big_endian)
+				num_entries = internal::IFDEntry::swap16(num_entries);
+			prefetch(offset, sizeof(uint16_t) + num_entries * sizeof(internal::IFDEntry));
+			for (uint32_t i = 0; i < num_entries; ++i) {
+				internal::IFDEntry e;
+				seek(offset + sizeof(uint16_t) + i * sizeof(internal::IFDEntry));
+				if (!read(e))
+					return false;
+				if (info.big_endian)
+					e.swap();
+				fn(e);
+			}
+			return true;
+		}
+
+		// The rational index of a rational entry, 0 when it can't be read
+		double readRational(const internal::IFDEntry& e, uint32_t index) {
+			if ((e.field_type != 5 && e.field_type != 10) || index >= e.num_items)
+				return 0.0;
+			// All the rationals of the entry come with the first one
+			uint32_t fraction[2] = { 0, 0 };
+			if (e.num_items <= 16)
+				prefetch(e.value, e.num_items * sizeof(fraction));
+			seek(e.value + index * sizeof(fraction));
+			if (!readBytes(fraction, sizeof(fraction)))
+				return 0.0;
+			if (info.big_endian)
+				internal::swapComponents(fraction, sizeof(fraction), 4);
+			if (fraction[1] == 0)
+				return 0.0;
+			if (e.field_type == 10)
+				return (double)(int32_t)fraction[0] / (double)(int32_t)fraction[1];
+			return (double)fraction[0] / (double)fraction[1];
+		}
+
+		// Degrees, minutes and seconds of the GPS coordinates as degrees
+		double readDegrees(const internal::IFDEntry& e) {
+			return readRational(e, 0) + readRational(e, 1) / 60.0 + readRational(e, 2) / 3600.0;
+		}
+
+		// Decodes the strips or tiles in num_threads threads (0: one per core), and calls
+		// fn(block_index, x, y, num_cols, num_rows, pixels) from the thread which decoded each one.
+		// Reads can't go in parallel, so blocks without a codec are always read in the calling thread, in order.
+		// Rows of pixels are blocks.block_row_bytes apart. Tiles are given complete, also in the borders.
+		// When direct is given, strips are decoded in place there, as rows of the image
+		template< typename Fn >
+		bool forEachBlock(const Blocks& blocks, int num_threads, uint8_t* direct, Fn fn) {
+			// The data is read as it is in the file, and swapped after decoding
+			bool saved_must_decode = must_decode;
+			must_decode = false;
+			int bytes_to_swap = swap_16b_data ? 2 : (swap_32b_data ? 4 : (swap_64b_data ? 8 : 0));
+			bool saved_swaps[3] = { swap_16b_data, swap_32b_data, swap_64b_data };
+			swap_16b_data = swap_32b_data = swap_64b_data = false;
+
+			size_t num_blocks = blocks.selected.empty() ? blocks.num_blocks : blocks.selected.size();
+			if (!codec || num_blocks < 2)
+				num_threads = 1;
+			if (num_threads <= 0)
+				num_threads = (int)std::thread::hardware_concurrency();
+			if (num_threads <= 0)
+				num_threads = 1;
+			if ((size_t)num_threads > num_blocks)
+				num_threads = (int)num_blocks;
+			if (block_buffers.size() < 2 * (size_t)num_threads)
+				block_buffers.resize(2 * num_threads);
+			bool is_ok = !codec || codec->begin(info, blocks.tables.data(), blocks.tables.size(), num_threads);
+
+			// Each thread takes the next block. File reads are serialized, the decode is not.
+			// In flight there are at most two buffers per thread
+			std::atomic< size_t > next_block(0);
+			std::atomic< bool > all_ok(is_ok);
+			std::mutex file_mutex;
+			auto decodeBlocks = [&](int thread_index) {
+				std::vector< uint8_t >& src = block_buffers[2 * thread_index];
+				std::vector< uint8_t >& scratch = block_buffers[2 * thread_index + 1];
+				size_t next;
+				while (all_ok && (next = next_block++) < num_blocks) {
+					size_t idx = blocks.selected.empty() ? next : blocks.selected[next];
+					size_t x = (idx % blocks.blocks_across) * blocks.block_w;
+					size_t y = (idx / blocks.blocks_across) * blocks.block_h;
+					size_t num_cols = (x + blocks.block_w > (size_t)info.w) ? info.w - x : blocks.block_w;
+					size_t num_rows = (y + blocks.block_h > (size_t)info.h) ? info.h - y : blocks.block_h;
+					size_t out_rows = blocks.is_tiled ? blocks.block_h : num_rows;
+					uint8_t* out = direct ? direct + y * blocks.row_bytes : nullptr;
+					if (!direct) {
+						scratch.resize(blocks.block_row_bytes * out_rows);
+						out = scratch.data();
+					}
+					size_t out_bytes = blocks.block_row_bytes * out_rows;
+					bool block_ok;
+					{
+						std::lock_guard< std::mutex > lock(file_mutex);
+						seek(blocks.offsets[idx]);
+						if (codec) {
+							src.resize(blocks.sizes[idx]);
+							block_ok = readBytes(src.data(), src.size());
+						}
+						else {
+							block_ok = readBytes(out, out_bytes);
+						}
+					}
+					if (block_ok && codec) {
+						MINI_TIFF_PHASE_BEGIN(t_decompress);
+						block_ok = codec->decode(src.data(), src.size(), out, blocks.block_row_bytes, (int)out_rows, thread_index);
+						MINI_TIFF_PHASE_END(instrumentation, Phase::Decompress, t_decompress, out_bytes);
+					}
+					if (block_ok && bytes_to_swap)
+						internal::swapComponents(out, out_bytes, bytes_to_swap);
+					if (block_ok)
+						block_ok = fn(idx, (int)x, (int)y, (int)num_cols, (int)num_rows, (const uint8_t*)out);
+					if (!block_ok)
+						all_ok = false;
+				}
+			};
+			if (num_threads > 1)
+				workers.run(num_threads, decodeBlocks);
+			else
+				decodeBlocks(0);
+
+			swap_16b_data = saved_swaps[0];
+			swap_32b_data = saved_swaps[1];
+			swap_64b_data = saved_swaps[2];
+			must_decode = saved_must_decode;
+			return all_ok;
+		}
+
+		// Reads all the image into dst with the rows packed. Compressed strips/tiles are decoded in
+		// num_threads threads (0: one per core), the uncompressed ones are read in the calling thread.
+		// When apply_orientation is set, dst gets the image already oriented
+		bool readImage(void* dst, int num_threads = 0) {
+			size_t row_bytes = ((size_t)info.w * info.num_components * info.bits_per_component + 7) / 8;
+			if (!must_decode)
+				return readBytes(dst, row_bytes * info.h);
+
+			// Where each pixel of the file goes in dst
+			size_t pixel_bytes = info.num_components * info.bits_per_component / 8;
+			internal::Orientation orientation(apply_orientation ? info.orientation : 1, info.w, info.h, pixel_bytes);
+			// Strips go directly to dst when not oriented. Components of 1, 2, 4 or 12 bits are given packed, as they are in the strips
+			bool is_direct = info.tile_w == 0 && orientation.isIdentity();
+			if (info.bits_per_component % 8 && !is_direct)
+				return false;
+
+			Blocks blocks;
+			if (!getBlocks(blocks))
+				return false;
+			return forEachBlock(blocks, num_threads, is_direct ? (uint8_t*)dst : nullptr, [&](size_t idx, int x, int y, int num_cols, int num_rows, const uint8_t* pixels) {
+				if (!is_direct)
+					orientation.copy(pixels, blocks.block_row_bytes, num_cols, num_rows, (uint8_t*)dst, x, y);
+				return true;
+				});
+		}
+
+		// Reads CMYK (photometric 5) or YCbCr (photometric 6) images converted to 8 bits RGB, or RGBA when
+		// with_alpha is set. The alpha is the fifth component of CMYK images, or opaque.
+		// The conversion is done on each block read from the file, so there is no second pass over dst
+		bool readRGB(uint8_t* dst, bool with_alpha = false) {
+			if (info.photometric == 5)
+				return readCMYKAsRGB(dst, with_alpha);
+			if (info.photometric == 6)
+				return readYCbCrAsRGB(dst, with_alpha);
+			return false;
+		}
+
+		bool readCMYKAsRGB(uint8_t* dst, bool with_alpha) {
+			int nc = info.num_components;
+			int channels = with_alpha ? 4 : 3;
+			if (nc < 4 || (info.bits_per_component != 8 && info.bits_per_component != 16))
+				return false;
+			return readRows([&](const uint8_t* src, size_t first_value, size_t n) {
+				uint8_t* out = dst + first_value / nc * channels;
+				if (info.bits_per_component == 16)
+					internal::cmykToRGB((const uint16_t*)src, out, n / nc, nc, channels);
+				else
+					internal::cmykToRGB(src, out, n / nc, nc, channels);
+				});
+		}
+
+		bool readYCbCrAsRGB(uint8_t* dst, bool with_alpha) {
+			if (info.num_components != 3 || info.bits_per_component != 8)
+				return false;
+			int channels = with_alpha ? 4 : 3;
+			// JPEG gives the pixels already as RGB
+			if (info.compression == Compression_JPEG) {
+				return readRows([&](const uint8_t* src, size_t first_value, size_t n) {
+					uint8_t* out = dst + first_value / 3 * channels;
+					for (size_t i = 0; i < n; i += 3, out += channels) {
+						memcpy(out, src + i, 3);
+						if (with_alpha)
+							out[3] = 255;
+					}
+					});
+			}
+
+			// Otherwise the units are read in order from the strips, each one with whole rows of units.
+			// Subsampled data of other compressions or in tiles is not supported
+			Blocks blocks;
+			size_t strip = 0;
+			uint32_t strip_left = 0;
+			if (must_decode) {
+				if (info.compression != Compression_None || info.tile_w != 0 || (apply_orientation && info.orientation >= 2 && info.orientation <= 8))
+					return false;
+				if (!getBlocks(blocks))
+					return false;
+				seek(blocks.offsets[0]);
+				strip_left = blocks.sizes[0];
+			}
+			auto readUnits = [&](uint8_t* units, size_t num_bytes) {
+				if (!must_decode)
+					return readBytes(units, num_bytes);
+				RawReads raw(*this);
+				while (num_bytes > 0) {
+					while (strip_left == 0) {
+						if (++strip >= blocks.num_blocks)
+							return false;
+						seek(blocks.offsets[strip]);
+						strip_left = blocks.sizes[strip];
+					}
+					uint32_t n = num_bytes < strip_left ? (uint32_t)num_bytes : strip_left;
+					if (!readBytes(units, n))
+						return false;
+					units += n;
+					num_bytes -= n;
+					strip_left -= n;
+				}
+				// The next units continue from here
+				raw.position = position;
+				return true;
+			};
+
+			float coefficients[3] = { 0.299f, 0.587f, 0.114f };
+			float reference[6] = { 0.0f, 255.0f, 128.0f, 255.0f, 128.0f, 255.0f };
+			if (ifd.find(IFD_YCbCrCoefficients) && !ifd.rationals(IFD_YCbCrCoefficients, coefficients, 3))
+				return false;
+			if (ifd.find(IFD_ReferenceBlackWhite) && !ifd.rationals(IFD_ReferenceBlackWhite, reference, 6))
+				return false;
+			internal::YCbCrToRGB ycbcr;
+			ycbcr.init(coefficients, reference);
+
+			// Each data unit has sh x sv luma values followed by one Cb and one Cr.
+			// Units at the right and bottom borders are padded up to the full size
+			int sh = info.ycbcr_subsampling[0];
+			int sv = info.ycbcr_subsampling[1];
+			size_t unit_bytes = sh * sv + 2;
+			size_t units_per_row = (info.w + sh - 1) / sh;
+			size_t row_stride = (size_t)info.w * channels;
+			alignas(8) uint8_t staging[3 << 12];
+			size_t units_per_block = sizeof(staging) / unit_bytes;
+			for (int y = 0; y < info.h; y += sv) {
+				int num_rows = (y + sv > info.h) ? info.h - y : sv;
+				for (size_t u0 = 0; u0 < units_per_row; u0 += units_per_block) {
+					size_t num_units = (u0 + units_per_block > units_per_row) ? units_per_row - u0 : units_per_block;
+					if (!readUnits(staging, num_units * unit_bytes))
+						return false;
+					MINI_TIFF_PHASE_BEGIN(t_convert);
+					const uint8_t* unit = staging;
+					for (size_t u = u0; u < u0 + num_units; ++u, unit += unit_bytes) {
+						int x = (int)u * sh;
+						int num_cols = (x + sh > info.w) ? info.w - x : sh;
+						int cb = unit[sh * sv];
+						int cr = unit[sh * sv + 1];
+						for (int dy = 0; dy < num_rows; ++dy) {
+							uint8_t* out = dst + (y + dy) * row_stride + x * channels;
+							for (int dx = 0; dx < num_cols; ++dx, out += channels) {
+								ycbcr.toRGB(unit[dy * sh + dx], cb, cr, out);
+								if (with_alpha)
+									out[3] = 255;
+							}
+						}
+					}
+					MINI_TIFF_PHASE_END(instrumentation, Phase::Convert, t_convert, num_units * unit_bytes);
+				}
+			}
+			return true;
+		}
+
+		// Calls fn(src, first_value, num_values) for each row of the image in order, or part of a row when
+		// it doesn't fit in the buffer. Single strips are read by blocks of rows into a buffer in the stack.
+		// Other layouts are decoded block by block in this thread. Rows are never oriented, so it fails
+		// when apply_orientation would change them
+		template< typename Fn >
+		bool readRows(Fn fn) {
+			size_t values_per_row = (size_t)info.w * info.num_components;
+			size_t row_bytes = (values_per_row * info.bits_per_component + 7) / 8;
+			if (must_decode) {
+				if (apply_orientation && info.orientation >= 2 && info.orientation <= 8)
+					return false;
+				Blocks blocks;
+				if (!getBlocks(blocks))
+					return false;
+				// The tiles of each row of them are gathered in band, which is given when the last one arrives
+				size_t pixel_bytes = info.num_components * info.bits_per_component / 8;
+				std::vector< uint8_t > band(blocks.is_tiled ? row_bytes * blocks.block_h : 0);
+				return forEachBlock(blocks, 1, nullptr, [&](size_t idx, int x, int y, int num_cols, int num_rows, const uint8_t* pixels) {
+					size_t stride = blocks.block_row_bytes;
+					if (blocks.is_tiled) {
+						for (int r = 0; r < num_rows; ++r)
+							memcpy(band.data() + r * row_bytes + x * pixel_bytes, pixels + r * stride, num_cols * pixel_bytes);
+						if (x + num_cols < info.w)
+							return true;
+						pixels = band.data();
+						stride = row_bytes;
+					}
+					MINI_TIFF_PHASE_BEGIN(t_convert);
+					for (int r = 0; r < num_rows; ++r)
+						fn(pixels + r * stride, (size_t)(y + r) * values_per_row, values_per_row);
+					MINI_TIFF_PHASE_END(instrumentation, Phase::Convert, t_convert, num_rows * values_per_row);
+					return true;
+					});
+			}
+			// Multiple of 3 bytes, so rows longer than the buffer are split in complete values of 12 bits
+			alignas(8) uint8_t staging[3 << 12];
+			size_t first_value = 0;
+			if (row_bytes <= sizeof(staging)) {
+				size_t rows_per_block = sizeof(staging) / row_bytes;
+				for (int y = 0; y < info.h; y += (int)rows_per_block) {
+					size_t num_rows = (y + rows_per_block > (size_t)info.h) ? info.h - y : rows_per_block;
+					if (!readBytes(staging, num_rows * row_bytes))
+						return false;
+					MINI_TIFF_PHASE_BEGIN(t_convert);
+					for (size_t r = 0; r < num_rows; ++r, first_value += values_per_row)
+						fn(staging + r * row_bytes, first_value, values_per_row);
+					MINI_TIFF_PHASE_END(instrumentation, Phase::Convert, t_convert, num_rows * values_per_row);
+				}
+				return true;
+			}
+			// Very long rows. Each block contains a whole number of pixels, starting at a byte
+			size_t values_per_block = sizeof(staging) * 8 / info.bits_per_component;
+			values_per_block -= values_per_block % (info.num_components * 8);
+			for (int y = 0; y < info.h; ++y) {
+				size_t remaining = values_per_row;
+				while (remaining > 0) {
+					size_t n = remaining < values_per_block ? remaining : values_per_block;
+					size_t n_bytes = (n * info.bits_per_component + 7) / 8;
+					if (!readBytes(staging, n_bytes))
+						return false;
+					fn(staging, first_value, n);
+					first_value += n;
+					remaining -= n;
+				}
+			}
+			return true;
+		}
+
+		// Reads a rectangle of the image, as stored in the file, without orientation. Rows are packed in dst.
+		// Uncompressed single strips are read directly. Otherwise only the strips or tiles overlapping
+		// the rectangle are decoded, so codec must be set as in load.
+		// Pixels must start at a byte, so components of 1, 2, 4 or 12 bits are not supported, and neither
+		// is subsampled YCbCr
+		bool readRegion(const ImageInfo& info, int x, int y, int w, int h, void* dst) {
+			if (x < 0 || y < 0 || w <= 0 || h <= 0 || x + w > info.w || y + h > info.h)
+				return false;
+			if (info.bits_per_component % 8 != 0 || (info.photometric == 6 && info.compression != Compression_JPEG))
+				return false;
+			size_t bytes_per_pixel = info.num_components * info.bits_per_component / 8;
+			size_t src_row_bytes = info.w * bytes_per_pixel;
+			size_t dst_row_bytes = w * bytes_per_pixel;
+			uint8_t* out = (uint8_t*)dst;
+			if (must_decode) {
+				Blocks blocks;
+				if (!getBlocks(blocks))
+					return false;
+				for (size_t by = y / blocks.block_h; by <= (y + h - 1) / blocks.block_h; ++by)
+					for (size_t bx = x / blocks.block_w; bx <= (x + w - 1) / blocks.block_w; ++bx)
+						blocks.selected.push_back((uint32_t)(by * blocks.blocks_across + bx));
+				// The part of each block inside the rectangle
+				return forEachBlock(blocks, 1, nullptr, [&](size_t idx, int bx, int by, int num_cols, int num_rows, const uint8_t* pixels) {
+					int x0 = bx > x ? bx : x;
+					int y0 = by > y ? by : y;
+					int x1 = (bx + num_cols < x + w) ? bx + num_cols : x + w;
+					int y1 = (by + num_rows < y + h) ? by + num_rows : y + h;
+					for (int row = y0; row < y1; ++row)
+						memcpy(out + (row - y) * dst_row_bytes + (x0 - x) * bytes_per_pixel, pixels + (row - by) * blocks.block_row_bytes + (x0 - bx) * bytes_per_pixel, (x1 - x0) * bytes_per_pixel);
+					return true;
+					});
+			}
+			// Full rows are contiguous in the file
+			if (x == 0 && w == info.w) {
+				seek((uint32_t)(info.offset_for_data + y * src_row_bytes));
+				return readBytes(out, h * dst_row_bytes);
+			}
+			for (int row = 0; row < h; ++row, out += dst_row_bytes) {
+				seek((uint32_t)(info.offset_for_data + (y + row) * src_row_bytes + x * bytes_per_pixel));
+				if (!readBytes(out, dst_row_bytes))
+					return false;
+			}
+			return true;
+		}
+	};
+
+	struct SaveOptions {
+		uint16_t sample_format = 0;				// 0: floats for 32/64 bits, unsigned ints otherwise. Or one of SampleFormat_xxx
+		Instrumentation* instrumentation = nullptr;
+
+		// Metadata. Texts and blobs are not copied, they are written from here and must be valid during the save
+		float       x_resolution = 0.0f;			// Pixels per resolution_unit. 0: Not saved, readers assume 72 dpi
+		float       y_resolution = 0.0f;			// 0: Same as x_resolution
+		uint16_t    resolution_unit = 2;			// 1:None, 2:Inch, 3:Centimeter
+		const char* software = nullptr;
+		const char* date_time = nullptr;			// "YYYY:MM:DD HH:MM:SS"
+		const void* icc_profile = nullptr;
+		size_t      icc_profile_size = 0;
+		const void* xmp = nullptr;					// XML packet, without a null terminator
+		size_t      xmp_size = 0;
+	};
+
+	namespace internal {
+
+		// The IFD entries of the metadata of SaveOptions. Values not fitting in the entries are written
+		// from values_at as spans of the user data, each one starting in an even offset
+		struct MetadataTags {
+			IFDEntry entries[7];
+			int      num_entries = 0;
+			Span     spans[14];
+			int      num_spans = 0;
+			uint32_t values_size = 0;			// Bytes of all the spans
+			uint32_t resolution[4] = {};		// Numerator and denominator of x and y
+
+			MetadataTags(const SaveOptions& options, uint32_t new_values_at) : values_at(new_values_at) {
+				if (options.x_resolution > 0.0f) {
+					toRational(options.x_resolution, resolution);
+					toRational(options.y_resolution > 0.0f ? options.y_resolution : options.x_resolution, resolution + 2);
+					add(IFD_XResolution, 5, 1, resolution);
+					add(IFD_YResolution, 5, 1, resolution + 2);
+					add(IFD_ResolutionUnits, 3, 1, &options.resolution_unit);
+				}
+				if (options.software)
+					add(IFD_Software, 2, (uint32_t)strlen(options.software) + 1, options.software);
+				if (options.date_time)
+					add(IFD_DateTime, 2, (uint32_t)strlen(options.date_time) + 1, options.date_time);
+				if (options.xmp && options.xmp_size)
+					add(IFD_XMLPacket, 1, (uint32_t)options.xmp_size, options.xmp);
+				if (options.icc_profile && options.icc_profile_size)
+					add(IFD_ICCProfile, 7, (uint32_t)options.icc_profile_size, options.icc_profile);
+			}
+
+			// The entries are sorted, so each range can be written in its place of the IFD
+			void write(BufferWriter& f, uint16_t first_id, uint16_t last_id) const {
+				for (int i = 0; i < num_entries; ++i)
+					if (entries[i].id >= first_id && entries[i].id <= last_id)
+						f.write(entries[i]);
+			}
+
+		private:
+			uint32_t values_at = 0;
+
+			static void toRational(float v, uint32_t* fraction) {
+				fraction[1] = (v == (float)(uint32_t)v) ? 1 : 1000;
+				fraction[0] = (uint32_t)(v * fraction[1] + 0.5f);
+			}
+
+			void add(uint16_t id, uint16_t type, uint32_t count, const void* data) {
+				static const uint8_t zero = 0;
+				IFDEntry e(id, 0);
+				e.field_type = type;
+				e.num_items = count;
+				size_t num_bytes = (size_t)count * fieldTypeBytes(type);
+				if (num_bytes <= 4) {
+					memcpy(&e.value, data, num_bytes);
+				}
+				else {
+					if ((values_at + values_size) & 1) {
+						spans[num_spans].data = &zero;
+						spans[num_spans++].size = 1;
+						++values_size;
+					}
+					e.value = values_at + values_size;
+					spans[num_spans].data = data;
+					spans[num_spans++].size = num_bytes;
+					values_size += (uint32_t)num_bytes;
+				}
+				entries[num_entries++] = e;
+			}
+		};
+
+		// Fills out with the rows of the image as they must be stored in the file
+		typedef void (*RowConverter)(const void* data, int values_per_row, int bits_per_component, int first_row, int num_rows, uint8_t* out);
+
+		static void convertFloatsToHalfs(const void* data, int values_per_row, int bits_per_component, int first_row, int num_rows, uint8_t* out) {
+			floatsToHalfs((const float*)data + (size_t)first_row * values_per_row, (uint16_t*)out, (size_t)num_rows * values_per_row);
+		}
+
+		static void packRows(const void* data, int values_per_row, int bits_per_component, int first_row, int num_rows, uint8_t* out) {
+			const uint8_t* src = (const uint8_t*)data + (size_t)first_row * values_per_row;
+			size_t row_bytes = ((size_t)values_per_row * bits_per_component + 7) / 8;
+			for (int y = 0; y < num_rows; ++y, src += values_per_row, out += row_bytes)
+				packBits(src, out, values_per_row, bits_per_component);
+		}
+
+		static void packRows12(const void* data, int values_per_row, int bits_per_component, int first_row, int num_rows, uint8_t* out) {
+			const uint16_t* src = (const uint16_t*)data + (size_t)first_row * values_per_row;
+			size_t row_bytes = ((size_t)values_per_row * 12 + 7) / 8;
+			for (int y = 0; y < num_rows; ++y, src += values_per_row, out += row_bytes)
+				pack12(src, out, values_per_row);
+		}
+
+		static uint16_t sampleFormatToSave(const SaveOptions& options, int bits_per_component) {
+			if (options.sample_format != 0)
+				return options.sample_format;
+			return (bits_per_component >= 32) ? SampleFormat_Float : SampleFormat_UInt;
+		}
+
+		// Can we save images with this format?
+		static bool isValidToSave(int w, int h, int num_components, int bits_per_component, uint16_t sample_format) {
+			return (w > 0)
+				&& (h > 0)
+				&& (bits_per_component == 8 || bits_per_component == 16 || bits_per_component == 32 || bits_per_component == 64 || isPacked(bits_per_component))
+				&& (num_components == 1 || num_components == 3 || num_components == 4)
+				&& (sample_format == SampleFormat_UInt || sample_format == SampleFormat_Int || (sample_format == SampleFormat_Float && bits_per_component >= 16))
+				&& (sample_format == SampleFormat_UInt || !isPacked(bits_per_component));
+		}
+
+		static bool saveImage(const char* ofilename, int w, int h, int num_components, int bits_per_component, const void* data, const SaveOptions& options, RowConverter convert = nullptr) {
+
+			uint16_t sample_format = sampleFormatToSave(options, bits_per_component);
+
+			// Validate input parameters
+			if (!isValidToSave(w, h, num_components, bits_per_component, sample_format) || !data)
+				return false;
+
+			// Components of 1, 2, 4 or 12 bits are given one per uint8/uint16, and packed while saving
+			if (isPacked(bits_per_component) && !convert)
+				convert = (bits_per_component == 12) ? &packRows12 : &packRows;
+
+#ifdef MINI_TIFF_INSTRUMENTATION
+			Instrumentation* instrumentation = options.instrumentation;
+#endif
+
+			// Header, IFD and padding are built in memory and sent with the pixel data in one call
+			MINI_TIFF_PHASE_BEGIN(t_header);
+			uint32_t offset_for_data = 256;
+			uint8_t header_block[256] = {};
+			BufferWriter f(header_block, offset_for_data);
+
+			f.write(Header{});
+
+			// Each row starts in a new byte
+			size_t row_bytes = ((size_t)w * num_components * bits_per_component + 7) / 8;
+			uint32_t total_data_bytes = (uint32_t)(row_bytes * h);
+			uint32_t photometric_interpretation = (num_components == 1) ? 1 : 2;
+
+			// The values of the metadata go after the pixels
+			MetadataTags metadata(options, offset_for_data + total_data_bytes);
+
+			uint16_t num_ifds = 10 + metadata.num_entries;
+
+			// When saving floats or signed ints, we store an additional IFDEntry entry
+			if( sample_format != SampleFormat_UInt )
+				++num_ifds;
+
+			f.write(num_ifds);
+
+			// https://www.awaresystems.be/imaging/tiff/tifftags/baseline.html
+			f.write(IFDEntry(IFD_ImageType, 0));		// Image Type
+			f.write(IFDEntry(IFD_Width, w));			// width
+			f.write(IFDEntry(IFD_Height, h));			// Height
+			f.write(IFDEntry(IFD_BitsPerSample, bits_per_component));		// 1, 2, 4, 8, 12, 16, 32 or 64
+			f.write(IFDEntry(IFD_Compression, 1));		// Compression : 1 = none
+			f.write(IFDEntry(IFD_PhotometricInterpretation, photometric_interpretation));		// PhotometricInterpretation : 2: RGB, 1:Grey
+			f.write(IFDEntry(IFD_OffsetForData, offset_for_data));	// StripOffsets : offset to start of actual data
+			f.write(IFDEntry(IFD_NumComponents, num_components));		// SamplesPerPixel : 3
+			f.write(IFDEntry(IFD_RowsPerStrip, h));	// Height
+			f.write(IFDEntry(IFD_TotalBytesForData, total_data_bytes));
+			metadata.write(f, 0, IFD_SampleFormat - 1);		// Resolution, Software and DateTime
+
+			if( sample_format != SampleFormat_UInt )
+				f.write(IFDEntry(IFD_SampleFormat, sample_format));		// data are ints (2) or floats (3)
+			metadata.write(f, IFD_SampleFormat + 1, 0xffff);	// XMP and ICC
+
+			// Padding up to offset_for_data is already zero in the header_block
+			MINI_TIFF_PHASE_END(instrumentation, Phase::Header, t_header, offset_for_data);
+
+			MINI_TIFF_PHASE_BEGIN(t_open);
+			FileWriter fw;
+			if (!fw.create(ofilename))
+				return false;
+			MINI_TIFF_PHASE_END(instrumentation, Phase::Open, t_open, 0);
+
+			// Header, pixels and the values of the metadata
+			Span spans[2 + sizeof(metadata.spans) / sizeof(Span)];
+			spans[0].data = header_block;
+			spans[0].size = offset_for_data;
+			for (int i = 0; i < metadata.num_spans; ++i)
+				spans[2 + i] = metadata.spans[i];
+
+			if (!convert) {
+				MINI_TIFF_PHASE_BEGIN(t_write);
+				spans[1].data = data;
+				spans[1].size = total_data_bytes;
+				bool is_ok = fw.writeSpans(spans, 2 + metadata.num_spans);
+				MINI_TIFF_PHASE_END(instrumentation, Phase::Write, t_write, fw.bytes_written);
+				return is_ok;
+			}
+
+			// Convert blocks of rows into a staging buffer, and write each block after the previous one
+			size_t rows_per_block = (256 << 10) / row_bytes;
+			if (rows_per_block < 1)
+				rows_per_block = 1;
+			if (rows_per_block > (size_t)h)
+				rows_per_block = h;
+			std::vector< uint8_t > staging(rows_per_block * row_bytes);
+			// The header goes with the first block only
+			int first_span = 0;
+			for (int y = 0; y < h; y += (int)rows_per_block) {
+				int num_rows = (y + (int)rows_per_block > h) ? h - y : (int)rows_per_block;
+				MINI_TIFF_PHASE_BEGIN(t_convert);
+				convert(data, w * num_components, bits_per_component, y, num_rows, staging.data());
+				MINI_TIFF_PHASE_END(instrumentation, Phase::Convert, t_convert, num_rows * row_bytes);
+				MINI_TIFF_PHASE_BEGIN(t_write);
+				spans[1].data = staging.data();
+				spans[1].size = num_rows * row_bytes;
+				if (!fw.writeSpans(spans + first_span, 2 - first_span))
+					return false;
+				MINI_TIFF_PHASE_END(instrumentation, Phase::Write, t_write, num_rows * row_bytes);
+				first_span = 1;
+			}
+			return metadata.num_spans == 0 || fw.writeSpans(spans + 2, metadata.num_spans);
+		}
+	}
+
+	static bool save(const char* ofilename, int w, int h, int num_components, int bits_per_component, const void* data, const SaveOptions& options = SaveOptions() ) {
+		return internal::saveImage(ofilename, w, h, num_components, bits_per_component, data, options);
+	}
+
+	// Saves floats as 16 bits floats (half). The conversion is done while saving, by blocks
+	static bool saveHalf(const char* ofilename, int w, int h, int num_components, const float* data, SaveOptions options = SaveOptions()) {
+		options.sample_format = SampleFormat_Float;
+		return internal::saveImage(ofilename, w, h, num_components, 16, data, options, &internal::convertFloatsToHalfs);
+	}
+
+	namespace internal {
+		// The codec of the compression, if any. PackBits is used when the user codec is for something else
+		static bool findEncoder(uint16_t compression, Codec* codec, Codec* packbits, Codec*& encoder) {
+			encoder = nullptr;
+			if (compression == Compression_None)
+				return true;
+			if (codec && codec->compression() == compression)
+				encoder = codec;
+			else if (compression == Compression_PackBits)
+				encoder = packbits;
+			return encoder != nullptr;
+		}
+
+		// What the writers need to know of the image
+		struct BlockLayout {
+			int      w = 0;
+			int      h = 0;
+			int      num_components = 0;
+			int      bits_per_component = 0;
+			uint16_t sample_format = SampleFormat_UInt;
+			uint16_t photometric = 1;
+			uint16_t orientation = 1;
+			uint16_t compression = Compression_None;
+			bool     is_tiled = false;
+			uint32_t block_w = 0;				// The width of the image for strips
+			uint32_t block_h = 0;				// Rows per strip
+		};
+
+		// Writes the strips or tiles of an image in any order, from several threads at once. The header and IFD
+		// are written in create, and the tables of offsets and sizes patched in close. Each block is compressed
+		// in the calling thread, and appended to the file reserving its space with an atomic add
+		struct BlockWriter {
+			BlockLayout layout;
+			size_t   block_row_bytes = 0;
+			size_t   blocks_across = 0;
+			uint32_t num_blocks = 0;
+
+			~BlockWriter() {
+				close();
+			}
+
+			// The metadata of options, if given, is written between the header and the blocks
+			bool create(const char* ofilename, const BlockLayout& new_layout, Codec* new_encoder, Instrumentation* new_instrumentation, const SaveOptions* options = nullptr) {
+				layout = new_layout;
+				encoder = new_encoder;
+				instrumentation = new_instrumentation;
+				if (layout.block_w == 0 || layout.block_h == 0)
+					return false;
+				block_row_bytes = ((size_t)layout.block_w * layout.num_components * layout.bits_per_component + 7) / 8;
+				blocks_across = (layout.w + layout.block_w - 1) / layout.block_w;
+				num_blocks = (uint32_t)(blocks_across * ((layout.h + layout.block_h - 1) / layout.block_h));
+				block_offsets.assign(num_blocks, 0);
+				block_sizes.assign(num_blocks, 0);
+				written = std::unique_ptr< std::atomic< bool >[] >(new std::atomic< bool >[num_blocks]);
+				for (uint32_t i = 0; i < num_blocks; ++i)
+					written[i] = false;
+
+				// Header and IFD, followed by the tables of offsets and sizes when there are several blocks
+				MINI_TIFF_PHASE_BEGIN(t_header);
+				bool has_sample_format = layout.sample_format != SampleFormat_UInt;
+				bool has_orientation = layout.orientation != 1;
+				const SaveOptions& metadata_options = options ? *options : SaveOptions();
+				// The entries of the metadata are counted first, their values go after the tables
+				uint16_t num_ifds = 10 + (layout.is_tiled ? 1 : 0) + (has_sample_format ? 1 : 0) + (has_orientation ? 1 : 0) + MetadataTags(metadata_options, 0).num_entries;
+				size_t ifd_bytes = sizeof(Header) + 2 + num_ifds * sizeof(IFDEntry) + 4;
+				offsets_at = (uint32_t)((ifd_bytes + 3) & ~(size_t)3);
+				uint32_t data_at = offsets_at + (num_blocks > 1 ? num_blocks * 8 : 0);
+				MetadataTags metadata(metadata_options, data_at);
+				std::vector< uint8_t > header_block(data_at, 0);
+				BufferWriter f(header_block.data(), header_block.size());
+				f.write(Header{});
+				f.write(num_ifds);
+				IFDEntry offsets(layout.is_tiled ? IFD_TileOffsets : IFD_OffsetForData, num_blocks > 1 ? offsets_at : 0);
+				IFDEntry sizes(layout.is_tiled ? IFD_TileByteCounts : IFD_TotalBytesForData, num_blocks > 1 ? offsets_at + num_blocks * 4 : 0);
+				offsets.num_items = num_blocks;
+				sizes.num_items = num_blocks;
+				// With a single block, the offset and size are the values of the entries
+				sizes_at = offsets_at + num_blocks * 4;
+				f.write(IFDEntry(IFD_ImageType, 0));
+				f.write(IFDEntry(IFD_Width, layout.w));
+				f.write(IFDEntry(IFD_Height, layout.h));
+				f.write(IFDEntry(IFD_BitsPerSample, layout.bits_per_component));
+				f.write(IFDEntry(IFD_Compression, layout.compression));
+				f.write(IFDEntry(IFD_PhotometricInterpretation, layout.photometric));
+				if (!layout.is_tiled) {
+					if (num_blocks == 1)
+						offsets_at = (uint32_t)f.bytes_written + 8;
+					f.write(offsets);
+				}
+				if (has_orientation)
+					f.write(IFDEntry(IFD_Orientation, layout.orientation));
+				f.write(IFDEntry(IFD_NumComponents, layout.num_components));
+				if (!layout.is_tiled) {
+					f.write(IFDEntry(IFD_RowsPerStrip, layout.block_h));
+					if (num_blocks == 1)
+						sizes_at = (uint32_t)f.bytes_written + 8;
+					f.write(sizes);
+				}
+				metadata.write(f, 0, IFD_TileWidth - 1);
+				if (layout.is_tiled) {
+					f.write(IFDEntry(IFD_TileWidth, layout.block_w));
+					f.write(IFDEntry(IFD_TileLength, layout.block_h));
+					if (num_blocks == 1)
+						offsets_at = (uint32_t)f.bytes_written + 8;
+					f.write(offsets);
+					if (num_blocks == 1)
+						sizes_at = (uint32_t)f.bytes_written + 8;
+					f.write(sizes);
+				}
+				if (has_sample_format)
+					f.write(IFDEntry(IFD_SampleFormat, layout.sample_format));
+				metadata.write(f, IFD_SampleFormat + 1, 0xffff);
+				// Every entry must have been written, the offset of the next IFD is already 0
+				if (f.bytes_written + 4 != ifd_bytes)
+					return false;
+				MINI_TIFF_PHASE_END(instrumentation, Phase::Header, t_header, data_at);
+
+				MINI_TIFF_PHASE_BEGIN(t_open);
+				fw = std::unique_ptr< FileWriter >(new FileWriter());
+				if (!fw->create(ofilename)) {
+					fw.reset();
+					return false;
+				}
+				MINI_TIFF_PHASE_END(instrumentation, Phase::Open, t_open, 0);
+				Span spans[1 + sizeof(metadata.spans) / sizeof(Span)];
+				spans[0].data = header_block.data();
+				spans[0].size = header_block.size();
+				for (int i = 0; i < metadata.num_spans; ++i)
+					spans[1 + i] = metadata.spans[i];
+				if (!fw->writeSpans(spans, 1 + metadata.num_spans))
+					return false;
+				fflush(fw->f);
+				end_of_file = data_at + metadata.values_size;
+				return true;
+			}
+
+			// Rows stored in the block. Tiles are always complete, the last strip can be shorter
+			int blockRows(size_t idx) const {
+				if (layout.is_tiled)
+					return (int)layout.block_h;
+				int y = (int)(idx * layout.block_h);
+				return (y + (int)layout.block_h > layout.h) ? layout.h - y : (int)layout.block_h;
+			}
+
+			// data has blockRows(idx) rows of block_row_bytes each. Each block can only be written once
+			bool writeBlock(size_t idx, const void* data) {
+				if (!fw || idx >= num_blocks || written[idx].exchange(true))
+					return false;
+				Span span;
+				span.data = data;
+				span.size = block_row_bytes * blockRows(idx);
+				std::vector< uint8_t > encoded;
+				if (encoder) {
+					MINI_TIFF_PHASE_BEGIN(t_encode);
+					if (!encoder->encode((const uint8_t*)data, block_row_bytes, blockRows(idx), encoded))
+						return false;
+					MINI_TIFF_PHASE_END(instrumentation, Phase::Convert, t_encode, span.size);
+					span.data = encoded.data();
+					span.size = encoded.size();
+				}
+				uint64_t offset = end_of_file.fetch_add(span.size);
+				if (offset + span.size > 0xffffffffull)
+					return false;
+				block_offsets[idx] = (uint32_t)offset;
+				block_sizes[idx] = (uint32_t)span.size;
+				MINI_TIFF_PHASE_BEGIN(t_write);
+				bool is_ok = writeAt(offset, span.data, span.size);
+				MINI_TIFF_PHASE_END(instrumentation, Phase::Write, t_write, span.size);
+				return is_ok;
+			}
+
+			// Copies num blocks from first, already encoded and stored one after the other in src from src_offset
+			bool copyBlocks(size_t first, size_t num, const uint32_t* sizes, FILE* src, uint64_t src_offset) {
+				if (!fw || first + num > num_blocks)
+					return false;
+				uint64_t num_bytes = 0;
+				for (size_t i = 0; i < num; ++i) {
+					if (written[first + i].exchange(true) || sizes[i] == 0)
+						return false;
+					num_bytes += sizes[i];
+				}
+				uint64_t offset = end_of_file.fetch_add(num_bytes);
+				if (offset + num_bytes > 0xffffffffull)
+					return false;
+				uint64_t block_offset = offset;
+				for (size_t i = 0; i < num; ++i) {
+					block_offsets[first + i] = (uint32_t)block_offset;
+					block_sizes[first + i] = sizes[i];
+					block_offset += sizes[i];
+				}
+				MINI_TIFF_PHASE_BEGIN(t_write);
+				bool is_ok = copyAt(offset, src, src_offset, num_bytes);
+				MINI_TIFF_PHASE_END(instrumentation, Phase::Write, t_write, (size_t)num_bytes);
+				return is_ok;
+			}
+
+			// Patches the tables of offsets and sizes. Fails if some block is missing or could not be written
+			bool close() {
+				if (!fw)
+					return false;
+				bool is_ok = true;
+				for (uint32_t i = 0; i < num_blocks; ++i)
+					is_ok = is_ok && written[i] && block_sizes[i] != 0;
+				if (is_ok) {
+					is_ok = writeAt(offsets_at, block_offsets.data(), num_blocks * sizeof(uint32_t))
+						&& writeAt(sizes_at, block_sizes.data(), num_blocks * sizeof(uint32_t));
+				}
+				is_ok = (fclose(fw->f) == 0) && is_ok;
+				fw->f = nullptr;
+				fw.reset();
+				return is_ok;
+			}
+
+		private:
+			uint32_t offsets_at = 0;
+			uint32_t sizes_at = 0;
+			std::atomic< uint64_t > end_of_file{ 0 };
+			std::vector< uint32_t > block_offsets;
+			std::vector< uint32_t > block_sizes;
+			std::unique_ptr< std::atomic< bool >[] > written;
+			std::unique_ptr< FileWriter > fw;
+			Codec*   encoder = nullptr;
+			Instrumentation* instrumentation = nullptr;
+#ifdef _WIN32
+			std::mutex file_mutex;
+#endif
+
+			// Writes at any offset of the file. Several threads can call it at once
+			bool writeAt(uint64_t offset, const void* data, size_t num_bytes) {
+#ifdef _WIN32
+				std::lock_guard< std::mutex > lock(file_mutex);
+				return fw->writeAt((size_t)offset, data, num_bytes);
+#else
+				int fd = fileno(fw->f);
+				const uint8_t* p = (const uint8_t*)data;
+				while (num_bytes > 0) {
+					ssize_t rc = pwrite(fd, p, num_bytes, (off_t)offset);
+					if (rc < 0) {
+						if (errno == EINTR)
+							continue;
+						return false;
+					}
+					p += rc;
+					offset += rc;
+					num_bytes -= rc;
+				}
+				return true;
+#endif
+			}
+
+			// Copies bytes of src to the file. In linux copy_file_range keeps them in the kernel, and
+			// filesystems supporting reflinks just share the extents. Elsewhere, or when the files are
+			// in different filesystems, they go through a buffer
+			bool copyAt(uint64_t offset, FILE* src, uint64_t src_offset, uint64_t num_bytes) {
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+				loff_t off_in = (loff_t)src_offset;
+				loff_t off_out = (loff_t)offset;
+				while (num_bytes > 0) {
+					ssize_t rc = copy_file_range(fileno(src), &off_in, fileno(fw->f), &off_out, (size_t)num_bytes, 0);
+					if (rc < 0 && errno == EINTR)
+						continue;
+					if (rc <= 0)
+						break;
+					num_bytes -= rc;
+				}
+				src_offset = (uint64_t)off_in;
+				offset = (uint64_t)off_out;
+#endif
+				std::vector< uint8_t > buffer((size_t)(num_bytes < (1 << 20) ? num_bytes : (1 << 20)));
+				while (num_bytes > 0) {
+					size_t n = (size_t)(num_bytes < buffer.size() ? num_bytes : buffer.size());
+#ifdef _WIN32
+					if (fseek(src, (long)src_offset, SEEK_SET) != 0 || fread(buffer.data(), 1, n, src) != n)
+						return false;
+#else
+					ssize_t rc = pread(fileno(src), buffer.data(), n, (off_t)src_offset);
+					if (rc < 0 && errno == EINTR)
+						continue;
+					if (rc <= 0)
+						return false;
+					n = (size_t)rc;
+#endif
+					if (!writeAt(offset, buffer.data(), n))
+						return false;
+					src_offset += n;
+					offset += n;
+					num_bytes -= n;
+				}
+				return true;
+			}
+		};
+	}
+
+	// Writes an image as it's produced, some rows each time, so the full image is never needed in memory.
+	// The header and IFD are written in create, each group of rows_per_strip rows is compressed and written
+	// as a strip as soon as it's complete, and the offsets and sizes of the strips are patched in close.
+	// Rows are given as in save: one component of 1, 2, 4 or 12 bits per uint8/uint16
+	struct ScanlineWriter {
+		uint16_t compression = Compression_None;	// Or Compression_PackBits, or the compression of codec
+		Codec*   codec = nullptr;					// Encoder for other compressions
+		uint32_t rows_per_strip = 0;				// 0: Strips of about 64Kb
+
+		bool create(const char* ofilename, int w, int h, int num_components, int bits_per_component, const SaveOptions& options = SaveOptions()) {
+			using namespace internal;
+
+			BlockLayout layout;
+			layout.w = w;
+			layout.h = h;
+			layout.num_components = num_components;
+			layout.bits_per_component = bits_per_component;
+			layout.sample_format = sampleFormatToSave(options, bits_per_component);
+			layout.photometric = (num_components == 1) ? 1 : 2;
+			layout.compression = compression;
+			if (!isValidToSave(w, h, num_components, bits_per_component, layout.sample_format))
+				return false;
+			Codec* encoder = nullptr;
+			if (!findEncoder(compression, codec, &packbits, encoder))
+				return false;
+			convert = nullptr;
+			if (isPacked(bits_per_component))
+				convert = (bits_per_component == 12) ? &packRows12 : &packRows;
+			instrumentation = options.instrumentation;
+
+			size_t row_bytes = ((size_t)w * num_components * bits_per_component + 7) / 8;
+			uint32_t strip_rows = rows_per_strip;
+			if (strip_rows == 0)
+				strip_rows = (uint32_t)((64 << 10) / row_bytes);
+			if (strip_rows == 0)
+				strip_rows = 1;
+			if (strip_rows > (uint32_t)h)
+				strip_rows = h;
+			layout.block_w = w;
+			layout.block_h = strip_rows;
+			rows_written = 0;
+			rows_in_strip = 0;
+			return writer.create(ofilename, layout, encoder, instrumentation, &options);
+		}
+
+		// Adds the next num_rows rows of the image
+		bool writeRows(const void* data, int num_rows) {
+			const internal::BlockLayout& layout = writer.layout;
+			if (num_rows < 0 || rows_written + rows_in_strip + num_rows > layout.h)
+				return false;
+			size_t row_bytes = writer.block_row_bytes;
+			size_t values_per_row = (size_t)layout.w * layout.num_components;
+			size_t src_row_bytes = convert ? values_per_row * (layout.bits_per_component > 8 ? 2 : 1) : row_bytes;
+			const uint8_t* src = (const uint8_t*)data;
+			while (num_rows > 0) {
+				size_t strip_idx = rows_written / layout.block_h;
+				int strip_rows = writer.blockRows(strip_idx);
+				int rows_left = strip_rows - rows_in_strip;
+				// Complete strips which don't need any change are written from data
+				if (rows_in_strip == 0 && !convert && num_rows >= rows_left) {
+					if (!writer.writeBlock(strip_idx, src))
+						return false;
+					rows_written += strip_rows;
+					src += rows_left * src_row_bytes;
+					num_rows -= rows_left;
+					continue;
+				}
+				int n = (num_rows < rows_left) ? num_rows : rows_left;
+				strip.resize((size_t)strip_rows * row_bytes);
+				uint8_t* dst = strip.data() + rows_in_strip * row_bytes;
+				MINI_TIFF_PHASE_BEGIN(t_convert);
+				if (convert)
+					convert(src, (int)values_per_row, layout.bits_per_component, 0, n, dst);
+				else
+					memcpy(dst, src, n * row_bytes);
+				MINI_TIFF_PHASE_END(instrumentation, Phase::Convert, t_convert, n * row_bytes);
+				rows_in_strip += n;
+				src += n * src_row_bytes;
+				num_rows -= n;
+				if (rows_in_strip == strip_rows) {
+					if (!writer.writeBlock(strip_idx, strip.data()))
+						return false;
+					rows_written += strip_rows;
+					rows_in_strip = 0;
+				}
+			}
+			return true;
+		}
+
+		// Patches the offsets and sizes of the strips. Fails if not all the rows were given
+		bool close() {
+			return writer.close();
+		}
+
+	private:
+		internal::BlockWriter    writer;
+		internal::PackBitsCodec  packbits;
+		internal::RowConverter   convert = nullptr;
+		Instrumentation*         instrumentation = nullptr;
+		int                      rows_written = 0;		// In complete strips
+		int                      rows_in_strip = 0;		// Rows waiting in strip
+		std::vector< uint8_t >   strip;
+	};
+
+	// Writes a tiled image, receiving the tiles in any order and from several threads at once.
+	// The tables of offsets and sizes are reserved in create and patched in close. Each tile is
+	// compressed in the thread calling writeTile, and appended to the file reserving its space
+	// with an atomic add, so threads don't wait for each other
+	struct TileWriter {
+		uint16_t compression = Compression_None;	// Or Compression_PackBits, or the compression of codec
+		Codec*   codec = nullptr;					// Encoder for other compressions. Must be thread safe
+
+		// Tiles are tile_w x tile_h pixels, multiples of 16 as the tiff spec says.
+		// Components must be 8, 16, 32 or 64 bits
+		bool create(const char* ofilename, int w, int h, int num_components, int bits_per_component, int tile_w, int tile_h, const SaveOptions& options = SaveOptions()) {
+			using namespace internal;
+
+			BlockLayout layout;
+			layout.w = w;
+			layout.h = h;
+			layout.num_components = num_components;
+			layout.bits_per_component = bits_per_component;
+			layout.sample_format = sampleFormatToSave(options, bits_per_component);
+			layout.photometric = (num_components == 1) ? 1 : 2;
+			layout.compression = compression;
+			layout.is_tiled = true;
+			layout.block_w = tile_w;
+			layout.block_h = tile_h;
+			if (!isValidToSave(w, h, num_components, bits_per_component, layout.sample_format) || isPacked(bits_per_component))
+				return false;
+			if (tile_w <= 0 || tile_h <= 0 || (tile_w % 16) != 0 || (tile_h % 16) != 0)
+				return false;
+			Codec* encoder = nullptr;
+			if (!findEncoder(compression, codec, &packbits, encoder))
+				return false;
+			return writer.create(ofilename, layout, encoder, options.instrumentation, &options);
+		}
+
+		// data has the tile_h rows of tile_w pixels of the tile, also for the tiles in the borders
+		bool writeTile(int tx, int ty, const void* data) {
+			if (tx < 0 || ty < 0 || tx >= (int)writer.blocks_across)
+				return false;
+			return writer.writeBlock((size_t)ty * writer.blocks_across + tx, data);
+		}
+
+		// Patches the tables of offsets and sizes. Fails if some tile is missing or could not be written
+		bool close() {
+			return writer.close();
+		}
+
+	private:
+		internal::BlockWriter    writer;
+		internal::PackBitsCodec  packbits;
+	};
+
+	// Traces are enabled per decoder, see TiffDecoder::verbose
+	#define tiff_printf	 if( !verbose ) {} else printf
+
+	// Reusable decoder. The reader and its buffers are kept between files, so loading
+	// many files with the same decoder does not setup anything new per file.
+	// All the state lives in the decoder, use one instance per thread.
+	struct TiffDecoder {
+
+		FileReader f;
+		bool       verbose = false;		// Print the tags found while loading
+		bool       apply_orientation = false;	// load gives the oriented size, and readImage the oriented pixels
+		Instrumentation* instrumentation = nullptr;
+
+		// State of the file being parsed
+		bool       swap_bytes = false;
+		uint32_t   offset_ifd = 0;
+
+		// Codecs added by the user are checked before the built in ones
+		std::vector< Codec* > codecs;
+		internal::PackBitsCodec packbits;
+#ifdef MINI_TIFF_JPEG
+		internal::JPEGCodec jpeg;
+#endif
+
+		// The codec is not owned by the decoder, and must outlive it
+		void addCodec(Codec* codec) {
+			codecs.push_back(codec);
+		}
+
+		Codec* findCodec(uint16_t compression) {
+			for (Codec* codec : codecs)
+				if (codec->compression() == compression)
+					return codec;
+			if (compression == Compression_PackBits)
+				return &packbits;
+#ifdef MINI_TIFF_JPEG
+			if (compression == Compression_JPEG)
+				return &jpeg;
+#endif
+			return nullptr;
+		}
+
+		struct CloseOnExit {
+			FileReader& f;
+			~CloseOnExit() { f.close(); }
+		};
+
+		// Opens the file, reads the header and leaves the reader at the first IFD entry
+		bool beginIFD(const char* ifilename, uint16_t& num_ifds) {
+
+			using namespace internal;
+
+			MINI_TIFF_PHASE_BEGIN(t_open);
+			if (!f.open(ifilename))
+				return false;
+			f.instrumentation = instrumentation;
+			MINI_TIFF_PHASE_END(instrumentation, Phase::Open, t_open, 0);
+
+			// Small files are fully parsed from this first block
+			MINI_TIFF_PHASE_BEGIN(t_header);
+			f.prefetch(0, sizeof(Header));
+
+			Header header;
+			f.read(header);
+			if (!header.isValid())
+				return false;
+			MINI_TIFF_PHASE_END(instrumentation, Phase::Header, t_header, sizeof(Header));
+
+			swap_bytes = header.mustSwapBytes();
+			if( swap_bytes ) header.offset_first_ifd = IFDEntry::swap32( header.offset_first_ifd );
+			offset_ifd = header.offset_first_ifd;
+			tiff_printf("OffsetFirstIFD: %08x (%d). Swap:%d\n", header.offset_first_ifd , header.offset_first_ifd, swap_bytes );
+			return readIFDCount(num_ifds);
+		}
+
+		// Reads the number of entries of the IFD at offset_ifd, and prefetches all of them
+		bool readIFDCount(uint16_t& num_ifds) {
+			f.seek(offset_ifd);
+			f.prefetch(offset_ifd, sizeof(uint16_t));
+			num_ifds = 0;
+			if (!f.read(num_ifds))
+				return false;
+			if( swap_bytes ) num_ifds = internal::IFDEntry::swap16(num_ifds);
+
+			// All the entries and the offset to the next IFD
+			f.prefetch(offset_ifd, sizeof(uint16_t) + num_ifds * sizeof(internal::IFDEntry) + sizeof(uint32_t));
+			return true;
+		}
+
+		// Reads the entries following readIFDCount into f.ifd, and then the values not fitting in them,
+		// sorted by offset so nearby values come from the same prefetch block
+		bool readIFD(uint16_t num_ifds, uint32_t& offset_next_ifd) {
+			using namespace internal;
+			IFD& ifd = f.ifd;
+			ifd.clear();
+			uint16_t pending[IFD::max_entries];
+			uint32_t num_pending = 0;
+			uint32_t array_bytes = 0;
+			for (int i = 0; i < num_ifds; ++i) {
+				IFDEntry e;
+				if (!f.read(e))
+					return false;
+				if (swap_bytes) e.swap();
+				uint64_t num_bytes = (uint64_t)fieldTypeBytes(e.field_type) * e.num_items;
+				if (ifd.num_entries == IFD::max_entries)
+					continue;
+				IFD::Entry& entry = ifd.entries[ifd.num_entries];
+				entry = { e.id, e.field_type, e.num_items, e.value, ~0u };
+				// The byte after the values is 0, to end the texts. Unknown types are not read, and the
+				// tables of the strips and tiles are left to getBlocks, as they can be very large
+				bool is_block_table = e.id == IFD_OffsetForData || e.id == IFD_TotalBytesForData || e.id == IFD_TileOffsets || e.id == IFD_TileByteCounts;
+				if (num_bytes == 0) {
+				}
+				else if (num_bytes <= 4) {
+					entry.data_at = ifd.reserve(5);
+					memcpy(ifd.data() + entry.data_at, &e.value, 4);
+					ifd.data()[entry.data_at + 4] = 0;
+				}
+				// Arrays not in the file or over the budget of the IFD are not read, whatever their count says
+				else if (e.field_type != 1 && e.field_type != 6 && e.field_type != 7 && !is_block_table
+					&& array_bytes + num_bytes <= IFD::max_array_bytes && (uint64_t)e.value + num_bytes <= f.fileSize()) {
+					array_bytes += (uint32_t)num_bytes;
+					entry.data_at = ifd.reserve((uint32_t)num_bytes + 1);
+					ifd.data()[entry.data_at + num_bytes] = 0;
+					uint32_t k = num_pending++;
+					for (; k > 0 && ifd.entries[pending[k - 1]].value > e.value; --k)
+						pending[k] = pending[k - 1];
+					pending[k] = (uint16_t)ifd.num_entries;
+				}
+				++ifd.num_entries;
+			}
+			offset_next_ifd = 0;
+			if (!f.read(offset_next_ifd))
+				return false;
+			if (swap_bytes) offset_next_ifd = IFDEntry::swap32(offset_next_ifd);
+
+			for (uint32_t i = 0; i < num_pending; ++i) {
+				IFD::Entry& entry = ifd.entries[pending[i]];
+				uint32_t type_bytes = fieldTypeBytes(entry.type);
+				uint32_t num_bytes = type_bytes * entry.count;
+				if (num_bytes <= FileReader::prefetch_capacity)
+					f.prefetch(entry.value, num_bytes);
+				f.seek(entry.value);
+				uint8_t* values = ifd.data() + entry.data_at;
+				if (!f.readBytes(values, num_bytes)) {
+					entry.data_at = ~0u;
+					continue;
+				}
+				if (swap_bytes && type_bytes > 1)
+					swapComponents(values, num_bytes, (entry.type == 5 || entry.type == 10) ? 4 : type_bytes);
+			}
+			return true;
+		}
+
+		uint32_t readNextIFDOffset(uint16_t num_ifds) {
+			f.seek(offset_ifd + sizeof(uint16_t) + num_ifds * sizeof(internal::IFDEntry));
+			uint32_t next = 0;
+			if (!f.read(next))
+				return 0;
+			return swap_bytes ? internal::IFDEntry::swap32(next) : next;
+		}
+
+		// Parse the first IFD of the file into info. Values not supported by load are not rejected here
+		bool parse(const char* ifilename, ImageInfo& info) {
+
+			using namespace internal;
+
+			info = ImageInfo();
+
+			uint16_t num_ifds = 0;
+			MINI_TIFF_PHASE_BEGIN(t_ifd);
+			if (!beginIFD(ifilename, num_ifds))
+				return false;
+			info.big_endian = swap_bytes;
+			info.offset_first_ifd = offset_ifd;
+			if (!readIFD(num_ifds, info.offset_next_ifd))
+				return false;
+			const IFD& tags = f.ifd;
+
+			// The value shared by all the components, 0 if they are different
+			auto sameForAll = [&](uint16_t id) -> uint32_t {
+				uint32_t value = tags.get(id);
+				for (uint32_t i = 1; i < tags.count(id); ++i)
+					if (tags.get(id, 0, i) != value)
+						return 0;
+				return value;
+			};
+
+			for (uint32_t i = 0; i < tags.num_entries; ++i) {
+
+				const IFD::Entry& ifd = tags.entries[i];
+
+				tiff_printf("%04x:%04x:%04x:%08x %s: ", ifd.id, ifd.type, ifd.count, ifd.value, Tags::asStr( ifd.id ));
+
+				switch (ifd.id) {
+
+				case IFD_ImageType:
+					info.image_type = ifd.value;
+					break;
+
+				case IFD_Width:
+					tiff_printf("%d", ifd.value);
+					info.w = ifd.value;
+					break;
+
+				case IFD_Height:
+					tiff_printf("%d", ifd.value);
+					info.h = ifd.value;
+					break;
+
+				case IFD_BitsPerSample:
+					tiff_printf("(At @0x%08x)", ifd.value);
+					info.bits_per_component = sameForAll(IFD_BitsPerSample);
+					break;
+
+				case IFD_Compression:
+					tiff_printf("%d", ifd.value);
+					info.compression = ifd.value;
+					break;
+
+				case IFD_PhotometricInterpretation:
+					info.photometric = ifd.value;
+					break;
+
+				case IFD_OffsetForData:
+				case IFD_TileOffsets:
+					tiff_printf("(At @0x%08x)", ifd.value);
+					info.offset_for_data = ifd.value;
+					info.num_strips = ifd.count;
+					break;
+
+				case IFD_TileWidth:
+					info.tile_w = ifd.value;
+					break;
+
+				case IFD_TileLength:
+					info.tile_h = ifd.value;
+					break;
+
+				case IFD_JPEGTables:
+					info.jpeg_tables_at = ifd.value;
+					info.jpeg_tables_size = ifd.count;
+					break;
+
+				case IFD_NumComponents:
+					tiff_printf("%d", ifd.value);
+					info.num_components = ifd.value;
+					break;
+
+				case IFD_RowsPerStrip:
+					tiff_printf("%d (should be %d)", ifd.value, info.h);
+					info.rows_per_strip = ifd.value;
+					break;
+
+				case IFD_TotalBytesForData:
+				case IFD_TileByteCounts:
+					tiff_printf("%d", ifd.value);
+					info.total_data_bytes = ifd.value;
+					break;
+
+				case IFD_PlanarConfiguration:
+					info.planar_configuration = ifd.value;
+					break;
+
+				case IFD_SampleFormat:
+					tiff_printf("%d", ifd.value);
+					info.sample_format = (uint16_t)sameForAll(IFD_SampleFormat);
+					break;
+
+				case IFD_FillOrder:
+					tiff_printf("%d", ifd.value);
+					info.fill_order = ifd.value;
+					break;
+
+				case IFD_Orientation:
+					info.orientation = ifd.value;
+					break;
+
+				case IFD_ColorMap:
+					info.color_map_count = ifd.count;
+					break;
+
+				case IFD_InkSet:
+					info.ink_set = ifd.value;
+					break;
+
+				case IFD_YCbCrSubsampling:
+					info.ycbcr_subsampling[0] = (uint16_t)tags.get(IFD_YCbCrSubsampling, 2, 0);
+					info.ycbcr_subsampling[1] = (uint16_t)tags.get(IFD_YCbCrSubsampling, 2, 1);
+					tiff_printf("%dx%d", info.ycbcr_subsampling[0], info.ycbcr_subsampling[1]);
+					break;
+
+
+				case IFD_YCbCrPositioning:		// Chroma is replicated to all the pixels of the data unit
+					break;
+
+				// Blobs, read on demand with FileReader::readBlob
+				case IFD_ICCProfile:
+				case IFD_XMLPacket:
+				case IFD_Photoshop:
+					break;
+
+				// Ignored
+				case IFD_ExtraSamples:
+					break;
+				case IFD_Exif:
+					break;
+				case IFD_DateTime:
+					break;
+				case IFD_Software:
+					break;
+				case IFD_XResolution:			// Typically 72 inch
+				case IFD_YResolution:
+				case IFD_ResolutionUnits:		// Typically inch
+					break;
+				default:
+					break;
+				}
+
+				tiff_printf("\n");
+			}
+			info.num_pages = 1;
+			MINI_TIFF_PHASE_END(instrumentation, Phase::IFD, t_ifd, num_ifds * sizeof(IFDEntry));
+
+			info.is_valid = true;
+			return true;
+		}
+
+		// Can we give the pixels of this image to the load callback?
+		bool isSupported(const ImageInfo& info) {
+			if (info.w == 0 || info.h == 0 || info.total_data_bytes == 0 || info.offset_for_data == ~0u) {
+				tiff_printf( "Didn't read needed data: w:%d h:%d total_data_bytes:%d offset_for_data:%d\n", info.w, info.h, info.total_data_bytes, info.offset_for_data);
+				return false;
+			}
+			if (info.image_type != 0 || info.planar_configuration != 1)
+				return false;
+			if (info.compression != Compression_None && !findCodec(info.compression)) {
+				tiff_printf( "No codec for compression %d\n", info.compression);
+				return false;
+			}
+			// SampleFormat 4 is undefined data, which we give as uints
+			if (info.sample_format < SampleFormat_UInt || info.sample_format > 4)
+				return false;
+			// 0 is grey where 0 is white, 3 are indices to the ColorMap, 5 is CMYK, 6 is YCbCr
+			if (info.photometric != 2 && info.photometric != 1 && info.photometric != 0 && info.photometric != 3 && info.photometric != 5 && info.photometric != 6)
+				return false;
+			if (info.photometric == 3 && (info.num_components != 1 || info.bits_per_component > 8 || info.color_map_count != (3u << info.bits_per_component)))
+				return false;
+			if (info.photometric == 5 && (info.ink_set != 1 || info.num_components < 4 || info.num_components > 5 || (info.bits_per_component != 8 && info.bits_per_component != 16)))
+				return false;
+			if (info.photometric == 6) {
+				int sh = info.ycbcr_subsampling[0];
+				int sv = info.ycbcr_subsampling[1];
+				if (info.num_components != 3 || info.bits_per_component != 8)
+					return false;
+				if ((sh != 1 && sh != 2 && sh != 4) || (sv != 1 && sv != 2 && sv != 4) || sv > sh)
+					return false;
+			}
+			// Bits of packed components must start by the most significant bit
+			if (internal::isPacked(info.bits_per_component) && info.fill_order == 2)
+				return false;
+			// Several strips or tiles must be read with FileReader::readImage
+			if (info.rows_per_strip == 0 || (info.tile_w != 0 && info.tile_h == 0))
+				return false;
+			if (info.bits_per_component != 8 && info.bits_per_component != 16 && info.bits_per_component != 32 && info.bits_per_component != 64 && !internal::isPacked(info.bits_per_component)) {
+				tiff_printf( "Invalid bits per component: %d (%08x)\n", info.bits_per_component, info.bits_per_component);
+				return false;
+			}
+			return true;
+		}
+
+		template< typename Fn >
+		bool info(const char* ifilename, Fn fn ) {
+
+			using namespace internal;
+
+			CloseOnExit close_on_exit{ f };
+			uint16_t num_ifds = 0;
+			MINI_TIFF_PHASE_BEGIN(t_ifd);
+			if (!beginIFD(ifilename, num_ifds))
+				return false;
+
+			for (int i = 0; i < num_ifds; ++i) {
+				IFDEntry ifd;
+				f.read(ifd);
+				if( swap_bytes ) ifd.swap();
+			
+				fn( ifd.id, ifd.value, ifd.field_type, ifd.num_items );
+			}
+			MINI_TIFF_PHASE_END(instrumentation, Phase::IFD, t_ifd, num_ifds * sizeof(IFDEntry));
+
+			return true;
+		}
+
+		// Only the IFD and the Exif and GPS sub-IFDs are read, never the pixel data
+		bool exif(const char* ifilename, ExifInfo& exif) {
+			CloseOnExit close_on_exit{ f };
+			if (!parse(ifilename, f.info))
+				return false;
+			return f.readExif(exif);
+		}
+
+		// Only the header and the IFDs are read, never the pixel data
+		bool probe(const char* ifilename, ImageInfo& info) {
+			CloseOnExit close_on_exit{ f };
+			if (!parse(ifilename, info))
+				return false;
+
+			// Count the pages following the chain of IFDs
+			const uint32_t max_pages = 65536;
+			offset_ifd = info.offset_next_ifd;
+			while (offset_ifd != 0 && info.num_pages < max_pages) {
+				uint16_t num_ifds = 0;
+				if (!readIFDCount(num_ifds))
+					break;
+				++info.num_pages;
+				offset_ifd = readNextIFDOffset(num_ifds);
+			}
+			return true;
+		}
+
+		template< typename Fn >
+		bool load(const char* ifilename, Fn fn) {
+
+			CloseOnExit close_on_exit{ f };
+			ImageInfo info;
+			if (!parse(ifilename, info) || !isSupported(info))
+				return false;
+
+			tiff_printf( "Read needed data: w:%d h:%d bits_per_component:%d total_data_bytes:%d offset_for_data:%d\n", info.w, info.h, info.bits_per_component, info.total_data_bytes, info.offset_for_data);
+			f.apply_orientation = apply_orientation;
+			f.beginPixels(info);
+			f.codec = findCodec(info.compression);
+			if (apply_orientation && info.orientation >= 5 && info.orientation <= 8)
+				return fn(info.h, info.w, info.num_components, info.bits_per_component, f);
+			return fn(info.w, info.h, info.num_components, info.bits_per_component, f);
+		}
+
+		// Reads the rectangle x,y,w,h of the image into dst, with the rows packed. See FileReader::readRegion
+		bool loadRegion(const char* ifilename, int x, int y, int w, int h, void* dst) {
+			CloseOnExit close_on_exit{ f };
+			ImageInfo info;
+			if (!parse(ifilename, info) || !isSupported(info))
+				return false;
+			return readRegion(info, x, y, w, h, dst);
+		}
+
+		// Same as loadRegion, for the image of info already parsed and open
+		bool readRegion(const ImageInfo& info, int x, int y, int w, int h, void* dst) {
+			f.beginPixels(info);
+			f.codec = findCodec(info.compression);
+			return f.readRegion(info, x, y, w, h, dst);
+		}
+	};
+
+	#undef tiff_printf
+
+	template< typename Fn >
+	static bool info(const char* ifilename, Fn fn ) {
+		TiffDecoder decoder;
+		return decoder.info(ifilename, fn);
+	}
+
+	template< typename Fn, typename FnMeta = void>
+	static bool load(const char* ifilename, Fn fn) {
+		TiffDecoder decoder;
+		return decoder.load(ifilename, fn);
+	}
+
+	struct TranscodeOptions {
+		uint16_t compression = Compression_None;	// Of the new file. None, PackBits, or the compression of codec
+		Codec*   codec = nullptr;					// Used to decode and encode its compression
+		int      num_threads = 0;					// Threads decoding and encoding the blocks. 0: one per core
+		Instrumentation* instrumentation = nullptr;
+	};
+
+	// Writes the image of ifilename into ofilename as a little endian file, with another compression.
+	// The strips or tiles are streamed from one file to the other keeping their layout, so each thread
+	// only has a couple of blocks in memory whatever the size of the image. Blocks which don't change
+	// are copied without decoding them. Resolution, Software, DateTime, ICC profile and XMP are kept,
+	// other tags are dropped
+	static bool transcode(const char* ifilename, const char* ofilename, const TranscodeOptions& options = TranscodeOptions()) {
+		TiffDecoder decoder;
+		decoder.instrumentation = options.instrumentation;
+		if (options.codec)
+			decoder.addCodec(options.codec);
+		return decoder.load(ifilename, [&](int w, int h, int num_components, int bits_per_component, FileReader& f) {
+			const ImageInfo& info = f.info;
+			internal::BlockLayout layout;
+			layout.photometric = info.photometric;
+			// JPEG YCbCr is decoded as RGB. Other YCbCr data and palettes are not stored as rows of pixels
+			if (info.photometric == 6 && info.compression == Compression_JPEG)
+				layout.photometric = 2;
+			else if (info.photometric == 6 || info.photometric == 3)
+				return false;
+
+			FileReader::Blocks blocks;
+			if (!f.getBlocks(blocks))
+				return false;
+			layout.w = info.w;
+			layout.h = info.h;
+			layout.num_components = info.num_components;
+			layout.bits_per_component = info.bits_per_component;
+			layout.sample_format = info.sample_format;
+			layout.orientation = info.orientation;
+			layout.compression = options.compression;
+			layout.is_tiled = blocks.is_tiled;
+			layout.block_w = blocks.block_w;
+			layout.block_h = blocks.block_h;
+
+			internal::PackBitsCodec packbits;
+			Codec* encoder = nullptr;
+			if (!internal::findEncoder(options.compression, options.codec, &packbits, encoder))
+				return false;
+			// The metadata that save writes is kept: resolution, Software, DateTime, ICC profile and XMP
+			SaveOptions metadata;
+			std::vector< uint8_t > icc_profile, xmp;
+			if (f.ifd.rationals(IFD_XResolution, &metadata.x_resolution, 1)) {
+				f.ifd.rationals(IFD_YResolution, &metadata.y_resolution, 1);
+				metadata.resolution_unit = (uint16_t)f.ifd.get(IFD_ResolutionUnits, 2);
+			}
+			metadata.software = f.ifd.text(IFD_Software);
+			metadata.date_time = f.ifd.text(IFD_DateTime);
+			if (f.readBlob(IFD_ICCProfile, icc_profile)) {
+				metadata.icc_profile = icc_profile.data();
+				metadata.icc_profile_size = icc_profile.size();
+			}
+			if (f.readBlob(IFD_XMLPacket, xmp)) {
+				metadata.xmp = xmp.data();
+				metadata.xmp_size = xmp.size();
+			}
+
+			internal::BlockWriter writer;
+			if (!writer.create(ofilename, layout, encoder, options.instrumentation, &metadata))
+				return false;
+
+			// When the blocks would be encoded back to the same bytes, they are copied as they are.
+			// Blocks stored one after the other are copied with a single call
+			bool must_swap = f.swap_16b_data || f.swap_32b_data || f.swap_64b_data;
+			if (options.compression == info.compression && !must_swap && info.jpeg_tables_size == 0 && layout.photometric == info.photometric) {
+				if (blocks.sizes.empty()) {
+					for (size_t i = 0; i < blocks.num_blocks; ++i)
+						blocks.sizes.push_back((uint32_t)(blocks.block_row_bytes * writer.blockRows(i)));
+				}
+				bool is_ok = true;
+				for (size_t first = 0, n; is_ok && first < blocks.num_blocks; first += n) {
+					uint64_t end = (uint64_t)blocks.offsets[first] + blocks.sizes[first];
+					for (n = 1; first + n < blocks.num_blocks && blocks.offsets[first + n] == end; ++n)
+						end += blocks.sizes[first + n];
+					is_ok = writer.copyBlocks(first, n, &blocks.sizes[first], f.f, blocks.offsets[first]);
+				}
+				return writer.close() && is_ok;
+			}
+
+			bool is_ok = f.forEachBlock(blocks, options.num_threads, nullptr, [&](size_t idx, int x, int y, int num_cols, int num_rows, const uint8_t* pixels) {
+				return writer.writeBlock(idx, pixels);
+				});
+			return writer.close() && is_ok;
+			});
+	}
+
+	// A tag to add or replace with updateTags. data has count values of type, in native byte order.
+	// A count of 0 removes the tag
+	struct TagValue {
+		uint16_t    id = 0;
+		uint16_t    type = 2;
+		uint32_t    count = 0;
+		const void* data = nullptr;
+		TagValue() = default;
+		TagValue(uint16_t new_id, uint16_t new_type, uint32_t new_count, const void* new_data) : id(new_id), type(new_type), count(new_count), data(new_data) {}
+		// Null terminated text, like IFD_Software or IFD_DateTime ("YYYY:MM:DD HH:MM:SS")
+		static TagValue text(uint16_t id, const char* str) {
+			return TagValue(id, 2, (uint32_t)strlen(str) + 1, str);
+		}
+	};
+
+	// Adds, replaces or removes tags of the first IFD of an existing file, keeping its byte order. The pixels
+	// are never rewritten: the IFD is updated in place when the new one fits in the old space, otherwise
+	// it's appended at the end of the file, and then the header patched to point to it.
+	// The tags locating the strips and tiles can't be changed
+	static bool updateTags(const char* filename, const TagValue* tags, int num_tags) {
+		using namespace internal;
+		for (int i = 0; i < num_tags; ++i) {
+			uint16_t id = tags[i].id;
+			if (id == IFD_OffsetForData || id == IFD_TotalBytesForData || id == IFD_TileOffsets || id == IFD_TileByteCounts)
+				return false;
+			if (tags[i].count && (fieldTypeBytes(tags[i].type) == 0 || !tags[i].data))
+				return false;
+		}
+
+		FileWriter fw;
+		fw.f = fopen(filename, "r+b");
+		if (!fw.f)
+			return false;
+		Header header;
+		if (fread(&header, 1, sizeof(Header), fw.f) != sizeof(Header) || !header.isValid())
+			return false;
+		bool swap = header.mustSwapBytes();
+		auto fileOrder16 = [swap](uint16_t v) { return swap ? IFDEntry::swap16(v) : v; };
+		auto fileOrder32 = [swap](uint32_t v) { return swap ? IFDEntry::swap32(v) : v; };
+
+		// The entries are kept as they are in the file
+		uint32_t ifd_at = fileOrder32(header.offset_first_ifd);
+		uint16_t num_entries = 0;
+		if (fseek(fw.f, (long)ifd_at, SEEK_SET) != 0 || fread(&num_entries, 1, 2, fw.f) != 2)
+			return false;
+		num_entries = fileOrder16(num_entries);
+		std::vector< IFDEntry > old_entries(num_entries);
+		uint32_t next_ifd = 0;
+		if (fread(old_entries.data(), sizeof(IFDEntry), num_entries, fw.f) != num_entries || fread(&next_ifd, 1, 4, fw.f) != 4)
+			return false;
+
+		// New values not fitting in an entry are written apart, over the old value of the tag when it's big enough
+		struct Value {
+			uint16_t id;
+			std::vector< uint8_t > bytes;
+			uint32_t old_at;
+			uint32_t old_size;
+		};
+		std::vector< Value > values;
+		std::vector< IFDEntry > entries = old_entries;
+		for (int i = 0; i < num_tags; ++i) {
+			const TagValue& tag = tags[i];
+			size_t idx = 0;
+			while (idx < entries.size() && fileOrder16(entries[idx].id) < tag.id)
+				++idx;
+			bool found = idx < entries.size() && fileOrder16(entries[idx].id) == tag.id;
+			if (tag.count == 0) {
+				if (found)
+					entries.erase(entries.begin() + idx);
+				continue;
+			}
+			IFDEntry e;
+			e.id = fileOrder16(tag.id);
+			e.field_type = fileOrder16(tag.type);
+			e.num_items = fileOrder32(tag.count);
+			e.value = 0;
+			uint32_t type_bytes = fieldTypeBytes(tag.type);
+			std::vector< uint8_t > bytes((const uint8_t*)tag.data, (const uint8_t*)tag.data + (size_t)tag.count * type_bytes);
+			if (swap && type_bytes > 1)
+				swapComponents(bytes.data(), bytes.size(), (tag.type == 5 || tag.type == 10) ? 4 : type_bytes);
+			if (bytes.size() <= 4) {
+				memcpy(&e.value, bytes.data(), bytes.size());
+			}
+			else {
+				Value v = { tag.id, bytes, 0, 0 };
+				if (found) {
+					uint32_t old_size = fieldTypeBytes(fileOrder16(entries[idx].field_type)) * fileOrder32(entries[idx].num_items);
+					if (old_size > 4 && old_size >= bytes.size()) {
+						v.old_at = fileOrder32(entries[idx].value);
+						v.old_size = old_size;
+					}
+				}
+				for (auto it = values.begin(); it != values.end(); ++it) {
+					if (it->id == tag.id) {
+						values.erase(it);
+						break;
+					}
+				}
+				values.push_back(v);
+			}
+			if (found)
+				entries[idx] = e;
+			else
+				entries.insert(entries.begin() + idx, e);
+		}
+
+		bool in_place = entries.size() <= old_entries.size();
+		for (const Value& v : values)
+			in_place = in_place && v.old_size >= v.bytes.size();
+
+		uint32_t new_ifd_at = ifd_at;
+		size_t end_of_file = 0;
+		if (!in_place) {
+			if (fseek(fw.f, 0, SEEK_END) != 0)
+				return false;
+			end_of_file = (size_t)ftell(fw.f);
+		}
+		// Offsets in the file are word aligned
+		auto append = [&](const void* data, size_t num_bytes) -> uint32_t {
+			static const uint8_t zero = 0;
+			if (end_of_file & 1)
+				fw.writeAt(end_of_file++, &zero, 1);
+			uint32_t at = (uint32_t)end_of_file;
+			end_of_file += num_bytes;
+			return fw.writeAt(at, data, num_bytes) ? at : 0;
+		};
+
+		bool is_ok = true;
+		for (const Value& v : values) {
+			uint32_t at = v.old_at;
+			if (in_place)
+				is_ok = is_ok && fw.writeAt(v.old_at, v.bytes.data(), v.bytes.size());
+			else
+				is_ok = is_ok && (at = append(v.bytes.data(), v.bytes.size())) != 0;
+			for (IFDEntry& e : entries)
+				if (fileOrder16(e.id) == v.id)
+					e.value = fileOrder32(at);
+		}
+
+		// The unused entries of the old IFD are cleared
+		uint16_t new_num_entries = fileOrder16((uint16_t)entries.size());
+		std::vector< uint8_t > ifd(2 + (in_place ? old_entries.size() : entries.size()) * sizeof(IFDEntry) + 4, 0);
+		memcpy(ifd.data(), &new_num_entries, 2);
+		memcpy(ifd.data() + 2, entries.data(), entries.size() * sizeof(IFDEntry));
+		memcpy(ifd.data() + 2 + entries.size() * sizeof(IFDEntry), &next_ifd, 4);
+		if (in_place)
+			is_ok = is_ok && fw.writeAt(ifd_at, ifd.data(), ifd.size());
+		else
+			is_ok = is_ok && (new_ifd_at = append(ifd.data(), ifd.size())) != 0;
+
+		// The header is changed last, once the new IFD is complete in the file
+		if (is_ok && new_ifd_at != ifd_at) {
+			uint32_t offset_first_ifd = fileOrder32(new_ifd_at);
+			is_ok = fflush(fw.f) == 0 && fw.writeAt(4, &offset_first_ifd, 4);
+		}
+		is_ok = (fclose(fw.f) == 0) && is_ok;
+		fw.f = nullptr;
+		return is_ok;
+	}
+
+	// Reads the Exif and GPS metadata of the file without reading the pixels
+	static bool exif(const char* ifilename, ExifInfo& exif) {
+		TiffDecoder decoder;
+		return decoder.exif(ifilename, exif);
+	}
+
+	// Returns the description of the image without reading the pixels. Check is_valid
+	static ImageInfo probe(const char* ifilename) {
+		TiffDecoder decoder;
+		ImageInfo info;
+		decoder.probe(ifilename, info);
+		return info;
+	}
+
+	// Probes all the files using several threads. Results are in the same order as the filenames.
+	// Each thread claims small batches of files and reuses its own decoder. As this is IO bound,
+	// asking more threads than cores can help in network file systems. 0 means one per core.
+	static std::vector< ImageInfo > scan(const std::vector< std::string >& filenames, int num_threads = 0) {
+		std::vector< ImageInfo > infos(filenames.size());
+		if (num_threads <= 0)
+			num_threads = (int)std::thread::hardware_concurrency();
+		if (num_threads <= 0)
+			num_threads = 1;
+
+		const size_t batch_size = 16;
+		size_t num_batches = (filenames.size() + batch_size - 1) / batch_size;
+		if ((size_t)num_threads > num_batches)
+			num_threads = (int)num_batches;
+
+		std::atomic<size_t> next_batch(0);
+		auto worker = [&]() {
+			TiffDecoder decoder;
+			size_t batch;
+			while ((batch = next_batch++) < num_batches) {
+				size_t end = (batch + 1) * batch_size;
+				if (end > filenames.size())
+					end = filenames.size();
+				for (size_t i = batch * batch_size; i < end; ++i)
+					decoder.probe(filenames[i].c_str(), infos[i]);
+			}
+		};
+
+		// The calling thread also works
+		std::vector< std::thread > threads;
+		for (int i = 1; i < num_threads; ++i)
+			threads.emplace_back(worker);
+		worker();
+		for (auto& t : threads)
+			t.join();
+		return infos;
+	}
+
+	// Keeps files open between region reads, together with their parsed ImageInfo, so repeated
+	// reads of the same files skip the open and the parse of the header. Files are validated
+	// with their device, inode, size and modification time, in nanoseconds where the platform
+	// has them, before being reused, so a file replaced by a rename is opened again. Thread safe.
+	struct FileHandlePool {
+
+		struct Handle {
+			std::string filename;
+			TiffDecoder decoder;			// Owns the open reader
+			ImageInfo   info;
+			uint64_t    dev = 0;
+			uint64_t    inode = 0;
+			time_t      mtime = 0;
+			long        mtime_ns = 0;
+			uint64_t    size = 0;
+
+			void setStat(const struct stat& st) {
+				dev = (uint64_t)st.st_dev;
+				inode = (uint64_t)st.st_ino;
+				mtime = st.st_mtime;
+				mtime_ns = mtimeNanoseconds(st);
+				size = (uint64_t)st.st_size;
+			}
+
+			bool sameStat(const struct stat& st) const {
+				return dev == (uint64_t)st.st_dev && inode == (uint64_t)st.st_ino && mtime == st.st_mtime
+					&& mtime_ns == mtimeNanoseconds(st) && size == (uint64_t)st.st_size;
+			}
+		};
+		typedef std::unique_ptr< Handle > HandlePtr;
+
+		std::atomic<uint64_t> num_hits{ 0 };
+		std::atomic<uint64_t> num_misses{ 0 };
+
+		FileHandlePool(size_t new_max_open_files = 256) : max_open_files(new_max_open_files) {}
+
+		// Returns an open and parsed handle, which belongs to the caller until given back with release.
+		// Several threads can acquire the same file, each will get its own handle.
+		HandlePtr acquire(const char* ifilename) {
+			struct stat st;
+			if (stat(ifilename, &st) != 0)
+				return HandlePtr();
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				auto it = by_name.find(ifilename);
+				if (it != by_name.end()) {
+					HandlePtr h = std::move(*it->second);
+					lru.erase(it->second);
+					by_name.erase(it);
+					if (h->sameStat(st)) {
+						++num_hits;
+						return h;
+					}
+					// The file has changed, h is closed when it goes out of scope
+				}
+			}
+			++num_misses;
+
+			HandlePtr h(new Handle);
+			h->filename = ifilename;
+			h->setStat(st);
+			if (!h->decoder.parse(ifilename, h->info))
+				return HandlePtr();
+			return h;
+		}
+
+		// The handle becomes the most recently used. The oldest ones are closed when there are too many
+		void release(HandlePtr h) {
+			if (!h)
+				return;
+			std::lock_guard<std::mutex> lock(mutex);
+			std::string filename = h->filename;
+			lru.push_front(std::move(h));
+			by_name.insert(std::make_pair(filename, lru.begin()));
+			while (lru.size() > max_open_files) {
+				auto last = std::prev(lru.end());
+				auto range = by_name.equal_range((*last)->filename);
+				for (auto it = range.first; it != range.second; ++it) {
+					if (it->second == last) {
+						by_name.erase(it);
+						break;
+					}
+				}
+				lru.pop_back();
+			}
+		}
+
+		// Same as TiffDecoder::loadRegion, but using a pooled handle
+		bool loadRegion(const char* ifilename, int x, int y, int w, int h, void* dst) {
+			HandlePtr handle = acquire(ifilename);
+			if (!handle || !handle->decoder.isSupported(handle->info))
+				return false;
+			bool is_ok = handle->decoder.readRegion(handle->info, x, y, w, h, dst);
+			// Don't keep handles in an unknown state
+			if (is_ok)
+				release(std::move(handle));
+			return is_ok;
+		}
+
+		void clear() {
+			std::lock_guard<std::mutex> lock(mutex);
+			by_name.clear();
+			lru.clear();
+		}
+
+	private:
+		// Windows has only seconds, and the inode is 0
+		static long mtimeNanoseconds(const struct stat& st) {
+#if defined(__APPLE__)
+			return (long)st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+			(void)st;
+			return 0;
+#else
+			return (long)st.st_mtim.tv_nsec;
+#endif
+		}
+
+		std::mutex mutex;
+		std::list< HandlePtr > lru;				// Most recently used first
+		std::unordered_multimap< std::string, std::list< HandlePtr >::iterator > by_name;
+		size_t max_open_files = 0;
+	};
+
+	// Thread safe cache of decoded tiles limited by a memory budget. The least recently used
+	// tiles are evicted first. Tiles are split between shards, each with its own lock, so
+	// threads reading different tiles rarely wait for each other.
+	struct TileCache {
+
+		// page and level are for the loaders given to get. getTile reads the first image, with both 0
+		struct Key {
+			uint64_t file_id = 0;
+			uint32_t page = 0;
+			uint32_t level = 0;
+			uint32_t tile = 0;
+			bool operator==(const Key& k) const {
+				return file_id == k.file_id && page == k.page && level == k.level && tile == k.tile;
+			}
+		};
+
+		// Tiles given by the cache remain valid even after being evicted
+		typedef std::shared_ptr< const std::vector< uint8_t > > Tile;
+
+		std::atomic<uint64_t> num_hits{ 0 };
+		std::atomic<uint64_t> num_misses{ 0 };
+
+		TileCache(size_t new_budget_bytes, int new_num_shards = 16)
+			: shards(new_num_shards > 0 ? new_num_shards : 1)
+		{
+			budget_per_shard = new_budget_bytes / shards.size();
+		}
+
+		// Returns the tile, calling loader(std::vector<uint8_t>& out) -> bool to get it when it's not in the cache.
+		// The loader runs without any lock held, so two threads missing the same tile may both load it.
+		template< typename Fn >
+		Tile get(const Key& key, Fn loader) {
+			Shard& shard = shards[hash(key) % shards.size()];
+			{
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				auto it = shard.entries.find(key);
+				if (it != shard.entries.end()) {
+					shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+					++num_hits;
+					return it->second->tile;
+				}
+			}
+			++num_misses;
+
+			std::shared_ptr< std::vector< uint8_t > > data = std::make_shared< std::vector< uint8_t > >();
+			if (!loader(*data))
+				return Tile();
+
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto it = shard.entries.find(key);
+			if (it != shard.entries.end())
+				return it->second->tile;
+			shard.lru.push_front(Entry{ key, data });
+			shard.entries[key] = shard.lru.begin();
+			shard.bytes_used += data->size();
+
+			// Keep at least the tile we just added
+			while (shard.bytes_used > budget_per_shard && shard.lru.size() > 1) {
+				Entry& last = shard.lru.back();
+				shard.bytes_used -= last.tile->size();
+				shard.entries.erase(last.key);
+				shard.lru.pop_back();
+			}
+			return data;
+		}
+
+		// Reads the tile tx,ty of tile_w x tile_h pixels from the file, decoding only the strips or tiles
+		// of the file it overlaps. Tiles at the right and bottom edges are clipped to the image.
+		// Each key.tile is (ty << 16) | tx
+		Tile getTile(TiffDecoder& decoder, const char* ifilename, uint64_t file_id, int tx, int ty, int tile_w, int tile_h) {
+			Key key;
+			key.file_id = file_id;
+			key.tile = ((uint32_t)ty << 16) | (uint32_t)tx;
+			return get(key, [&](std::vector< uint8_t >& data) {
+				ImageInfo info;
+				TiffDecoder::CloseOnExit close_on_exit{ decoder.f };
+				if (!decoder.parse(ifilename, info) || !decoder.isSupported(info))
+					return false;
+				int x = tx * tile_w;
+				int y = ty * tile_h;
+				int w = (x + tile_w > info.w) ? info.w - x : tile_w;
+				int h = (y + tile_h > info.h) ? info.h - y : tile_h;
+				if (w <= 0 || h <= 0)
+					return false;
+				data.resize((size_t)w * h * info.num_components * info.bits_per_component / 8);
+				return decoder.readRegion(info, x, y, w, h, data.data());
+				});
+		}
+
+		// Same as above, but the file is read using an open handle of the pool
+		Tile getTile(FileHandlePool& pool, const char* ifilename, uint64_t file_id, int tx, int ty, int tile_w, int tile_h) {
+			Key key;
+			key.file_id = file_id;
+			key.tile = ((uint32_t)ty << 16) | (uint32_t)tx;
+			return get(key, [&](std::vector< uint8_t >& data) {
+				FileHandlePool::HandlePtr handle = pool.acquire(ifilename);
+				if (!handle)
+					return false;
+				const ImageInfo& info = handle->info;
+				int x = tx * tile_w;
+				int y = ty * tile_h;
+				int w = (x + tile_w > info.w) ? info.w - x : tile_w;
+				int h = (y + tile_h > info.h) ? info.h - y : tile_h;
+				if (w <= 0 || h <= 0 || !handle->decoder.isSupported(info))
+					return false;
+				data.resize((size_t)w * h * info.num_components * info.bits_per_component / 8);
+				if (!handle->decoder.readRegion(info, x, y, w, h, data.data()))
+					return false;
+				pool.release(std::move(handle));
+				return true;
+				});
+		}
+
+		void clear() {
+			for (auto& shard : shards) {
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				shard.entries.clear();
+				shard.lru.clear();
+				shard.bytes_used = 0;
+			}
+		}
+
+		size_t bytesUsed() {
+			size_t total = 0;
+			for (auto& shard : shards) {
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				total += shard.bytes_used;
+			}
+			return total;
+		}
+
+	private:
+
+		struct Entry {
+			Key  key;
+			Tile tile;
+		};
+
+		struct KeyHash {
+			size_t operator()(const Key& k) const { return (size_t)hash(k); }
+		};
+
+		struct Shard {
+			std::mutex mutex;
+			std::list< Entry > lru;			// Most recently used first
+			std::unordered_map< Key, std::list< Entry >::iterator, KeyHash > entries;
+			size_t bytes_used = 0;
+		};
+
+		static uint64_t hash(const Key& k) {
+			uint64_t h = k.file_id * 0x9E3779B97F4A7C15ull;
+			h ^= ((uint64_t)k.page << 48) ^ ((uint64_t)k.level << 32) ^ k.tile;
+			h ^= h >> 29;
+			h *= 0xBF58476D1CE4E5B9ull;
+			return h ^ (h >> 32);
+		}
+
+		std::vector< Shard > shards;
+		size_t budget_per_shard = 0;
+	};
+
 
 }
@@ -0,0 +1,240 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "../mini_tiff.h"
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+
+// Measures save/load throughput of synthetic images for all the supported formats.
+// Usage: bench [max_size] [output.json]
+//   max_size defaults to 4096. Sizes go from 32x32 up to max_size x max_size (16384 max)
+//   Results are printed and also saved as json so they can be compared between versions
+
+struct Config {
+	int         size;
+	int         num_comps;
+	int         bits_per_comp;
+	bool        big_endian;
+};
+
+struct Result {
+	const char* op;
+	Config      cfg;
+	size_t      bytes;
+	double      seconds;			// Best time of all the iterations
+	int         iterations;
+};
+
+static double now() {
+	using namespace std::chrono;
+	return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static const char* formatName(int num_comps) {
+	return num_comps == 1 ? "G" : (num_comps == 3 ? "RGB" : "RGBA");
+}
+
+// MiniTiff::save only writes little endian files, so big endian files are written here
+// with the same layout Photoshop uses: FillOrder tag present and data swapped.
+struct BEWriter {
+	FILE* f = nullptr;
+	void put16(uint16_t v) {
+		uint8_t b[2] = { (uint8_t)(v >> 8), (uint8_t)v };
+		fwrite(b, 1, 2, f);
+	}
+	void put32(uint32_t v) {
+		uint8_t b[4] = { (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v };
+		fwrite(b, 1, 4, f);
+	}
+	void entry(uint16_t id, uint16_t type, uint32_t value) {
+		put16(id);
+		put16(type);
+		put32(1);
+		if (type == 3) {
+			put16((uint16_t)value);
+			put16(0);
+		}
+		else
+			put32(value);
+	}
+};
+
+static bool saveBigEndian(const char* ofilename, int w, int h, int num_comps, int bits_per_comp, const void* data) {
+	BEWriter bw;
+	bw.f = fopen(ofilename, "wb");
+	if (!bw.f)
+		return false;
+
+	uint32_t bytes_per_comp = bits_per_comp / 8;
+	uint32_t total_bytes = w * h * num_comps * bytes_per_comp;
+	uint16_t num_entries = bits_per_comp >= 32 ? 11 : 10;
+	uint32_t offset_for_data = 8 + 2 + num_entries * 12 + 4;
+
+	fwrite("MM\0*", 1, 4, bw.f);
+	bw.put32(8);
+	bw.put16(num_entries);
+	bw.entry(MiniTiff::IFD_Width, 4, w);
+	bw.entry(MiniTiff::IFD_Height, 4, h);
+	bw.entry(MiniTiff::IFD_BitsPerSample, 3, bits_per_comp);
+	bw.entry(MiniTiff::IFD_Compression, 3, 1);
+	bw.entry(MiniTiff::IFD_PhotometricInterpretation, 3, num_comps == 1 ? 1 : 2);
+	bw.entry(MiniTiff::IFD_FillOrder, 3, 1);
+	bw.entry(MiniTiff::IFD_OffsetForData, 4, offset_for_data);
+	bw.entry(MiniTiff::IFD_NumComponents, 3, num_comps);
+	bw.entry(MiniTiff::IFD_RowsPerStrip, 4, h);
+	bw.entry(MiniTiff::IFD_TotalBytesForData, 4, total_bytes);
+	if (bits_per_comp >= 32)
+		bw.entry(MiniTiff::IFD_SampleFormat, 3, 3);
+	bw.put32(0);
+
+	std::vector< uint8_t > swapped((const uint8_t*)data, (const uint8_t*)data + total_bytes);
+	for (size_t i = 0; i < total_bytes; i += bytes_per_comp)
+		for (uint32_t k = 0; k < bytes_per_comp / 2; ++k)
+			std::swap(swapped[i + k], swapped[i + bytes_per_comp - 1 - k]);
+	bool is_ok = fwrite(swapped.data(), 1, total_bytes, bw.f) == total_bytes;
+	fclose(bw.f);
+	return is_ok;
+}
+
+static void fillSynthetic(std::vector< uint8_t >& data, const Config& cfg) {
+	// A gradient, so the data is not all zeros
+	size_t n = data.size();
+	uint32_t x = 12345;
+	for (size_t i = 0; i < n; ++i) {
+		x = x * 1103515245 + 12345;
+		data[i] = (uint8_t)((i & 0xff) ^ (x >> 24));
+	}
+	// Keep floats as valid numbers
+	if (cfg.bits_per_comp == 32) {
+		float* p = (float*)data.data();
+		for (size_t i = 0; i < n / 4; ++i)
+			p[i] = (float)(i % 1024) / 1024.0f;
+	}
+	if (cfg.bits_per_comp == 64) {
+		double* p = (double*)data.data();
+		for (size_t i = 0; i < n / 8; ++i)
+			p[i] = (double)(i % 1024) / 1024.0;
+	}
+}
+
+// Repeats fn until at least min_bytes have been moved or min_seconds has passed
+template< typename Fn >
+static Result measure(const char* op, const Config& cfg, size_t bytes, Fn fn) {
+	const size_t min_bytes = 256 << 20;
+	const double min_seconds = 0.25;
+	Result r = { op, cfg, bytes, 1e30, 0 };
+	size_t total_bytes = 0;
+	double start = now();
+	do {
+		double t0 = now();
+		if (!fn()) {
+			r.iterations = -1;
+			return r;
+		}
+		double elapsed = now() - t0;
+		if (elapsed < r.seconds)
+			r.seconds = elapsed;
+		total_bytes += bytes;
+		++r.iterations;
+	} while (total_bytes < min_bytes && now() - start < min_seconds);
+	return r;
+}
+
+int main(int argc, char** argv) {
+
+	int max_size = argc > 1 ? atoi(argv[1]) : 4096;
+	const char* ofilename = argc > 2 ? argv[2] : "bench.json";
+	const char* tmp_filename = "bench_tmp.tif";
+
+	std::vector< Result > results;
+	std::vector< uint8_t > src;
+	std::vector< uint8_t > dst;
+	MiniTiff::TiffDecoder decoder;
+
+	const int sizes[] = { 32, 128, 512, 2048, 4096, 8192, 16384 };
+	const int comps[] = { 1, 3, 4 };
+	const int bits[] = { 8, 16, 32, 64 };
+
+	printf("%-9s %-4s %3s %2s %11s %10s %10s\n", "op", "fmt", "bpc", "BE", "size", "MB/s", "ns/pixel");
+	for (int size : sizes) {
+		if (size > max_size)
+			break;
+		for (int nc : comps) {
+			for (int bpc : bits) {
+				for (int be = 0; be < 2; ++be) {
+					Config cfg = { size, nc, bpc, be != 0 };
+					uint64_t bytes = (uint64_t)size * size * nc * bpc / 8;
+					// Classic tiffs can't store more than 4Gb
+					if (bytes >= 0xffffffffull)
+						continue;
+
+					src.resize(bytes);
+					fillSynthetic(src, cfg);
+
+					size_t first_result = results.size();
+					if (be) {
+						// The file is written once, then we measure the load with the swap of the components
+						if (!saveBigEndian(tmp_filename, size, size, nc, bpc, src.data()))
+							continue;
+					}
+					else {
+						results.push_back(measure("save", cfg, bytes, [&]() {
+							return MiniTiff::save(tmp_filename, size, size, nc, bpc, src.data());
+							}));
+					}
+
+					dst.resize(bytes);
+					results.push_back(measure(be ? "load_swap" : "load", cfg, bytes, [&]() {
+						return decoder.load(tmp_filename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+							return f.readBytes(dst.data(), dst.size());
+							});
+						}));
+
+					// Conversion of floats to/from half floats
+					if (!be && bpc == 32) {
+						results.push_back(measure("save_half", cfg, bytes, [&]() {
+							return MiniTiff::saveHalf(tmp_filename, size, size, nc, (const float*)src.data());
+							}));
+						results.push_back(measure("load_half", cfg, bytes, [&]() {
+							return decoder.load(tmp_filename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+								return f.readHalfAsFloat((float*)dst.data(), dst.size() / sizeof(float));
+								});
+							}));
+					}
+
+					for (size_t i = first_result; i < results.size(); ++i) {
+						const Result& r = results[i];
+						if (r.iterations < 0) {
+							printf("%-9s %-4s %3d %2d %5dx%-5d FAILED\n", r.op, formatName(nc), bpc, be, size, size);
+							continue;
+						}
+						printf("%-9s %-4s %3d %2d %5dx%-5d %10.1f %10.3f\n", r.op, formatName(nc), bpc, be, size, size
+							, r.bytes / r.seconds / (1024.0 * 1024.0)
+							, r.seconds * 1e9 / ((double)size * size));
+					}
+				}
+			}
+		}
+	}
+	remove(tmp_filename);
+
+	FILE* f = fopen(ofilename, "wb");
+	if (!f) {
+		printf("Failed to create %s\n", ofilename);
+		return -1;
+	}
+	fprintf(f, "{\n  \"results\": [\n");
+	for (size_t i = 0; i < results.size(); ++i) {
+		const Result& r = results[i];
+		bool ok = r.iterations > 0;
+		fprintf(f, "    { \"op\": \"%s\", \"format\": \"%s\", \"bits\": %d, \"endian\": \"%s\", \"width\": %d, \"height\": %d, \"bytes\": %zu, \"iterations\": %d, \"ok\": %s, \"mb_per_s\": %.3f, \"ns_per_pixel\": %.4f }%s\n"
+			, r.op, formatName(r.cfg.num_comps), r.cfg.bits_per_comp, r.cfg.big_endian ? "BE" : "LE", r.cfg.size, r.cfg.size
+			, r.bytes, r.iterations, ok ? "true" : "false"
+			, ok ? r.bytes / r.seconds / (1024.0 * 1024.0) : 0.0
+			, ok ? r.seconds * 1e9 / ((double)r.cfg.size * r.cfg.size) : 0.0
+			, i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	fclose(f);
+	printf("Results saved to %s\n", ofilename);
+	return 0;
+}
@@ -1,6 +1,11 @@
 #define _CRT_SECURE_NO_WARNINGS
+#define MINI_TIFF_INSTRUMENTATION
 #include "../mini_tiff.h"
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <string>
+#include <thread>
 #include <vector>
 
 struct Test {
@@ -17,6 +22,12 @@ bool runTest(const Test& t) {
 
 	printf( "Loading %s\n", t.filename );
 
+	MiniTiff::ImageInfo info = MiniTiff::probe(t.filename);
+	if (!info.is_valid || info.w != t.w || info.h != t.h || info.num_components != t.num_comps || info.bits_per_component != t.bits_per_comp) {
+		printf("%20s : probe doesn't match\n", t.filename);
+		return false;
+	}
+
 	std::vector< uint8_t > color_data;
 	int ah = 0, aw = 0, anum_comps;
 
@@ -63,6 +74,1247 @@ bool runTest(const Test& t) {
 	return is_ok;
 }
 
+// Adds the bytes and the number of calls of each phase
+struct PhaseCounter : public MiniTiff::Instrumentation {
+	uint64_t bytes[(int)MiniTiff::Phase::Write + 1] = {};
+	int      calls[(int)MiniTiff::Phase::Write + 1] = {};
+	void onPhase(MiniTiff::Phase phase, uint64_t nanoseconds, uint64_t num_bytes) override {
+		bytes[(int)phase] += num_bytes;
+		calls[(int)phase]++;
+	}
+};
+
+// The phases of loading a big endian file and saving it again report the bytes they handled
+bool testInstrumentation() {
+	const char* ifilename = "RGBA_32x32_16b_BE.tif";
+	const char* ofilename = "saved_instrumented.tif";
+	const size_t pixel_bytes = 32 * 32 * 4 * 2;
+
+	// The number of IFD entries, from the big endian header
+	uint8_t header[8], count[2];
+	FILE* fin = fopen(ifilename, "rb");
+	if (!fin)
+		return false;
+	bool header_ok = fread(header, 1, 8, fin) == 8
+		&& fseek(fin, (header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7], SEEK_SET) == 0
+		&& fread(count, 1, 2, fin) == 2;
+	fclose(fin);
+	if (!header_ok || header[0] != 'M')
+		return false;
+	uint64_t ifd_bytes = ((count[0] << 8) | count[1]) * sizeof(MiniTiff::internal::IFDEntry);
+
+	PhaseCounter load_counter;
+	MiniTiff::TiffDecoder decoder;
+	decoder.instrumentation = &load_counter;
+	std::vector< uint8_t > pixels(pixel_bytes);
+	if (!decoder.load(ifilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) { return f.readImage(pixels.data()); }))
+		return false;
+	using MiniTiff::Phase;
+	if (load_counter.calls[(int)Phase::Open] != 1 || load_counter.bytes[(int)Phase::Header] != 8
+		|| load_counter.calls[(int)Phase::IFD] != 1 || load_counter.bytes[(int)Phase::IFD] != ifd_bytes
+		|| load_counter.bytes[(int)Phase::PixelRead] != pixel_bytes || load_counter.bytes[(int)Phase::ByteSwap] != pixel_bytes
+		|| load_counter.calls[(int)Phase::Write] != 0)
+		return false;
+
+	PhaseCounter save_counter;
+	MiniTiff::SaveOptions options;
+	options.instrumentation = &save_counter;
+	if (!MiniTiff::save(ofilename, 32, 32, 4, 16, pixels.data(), options))
+		return false;
+	FILE* fout = fopen(ofilename, "rb");
+	if (!fout)
+		return false;
+	fseek(fout, 0, SEEK_END);
+	long file_size = ftell(fout);
+	fclose(fout);
+	return save_counter.calls[(int)Phase::Open] == 1 && save_counter.calls[(int)Phase::Header] == 1
+		&& save_counter.bytes[(int)Phase::Write] == (uint64_t)file_size && save_counter.calls[(int)Phase::PixelRead] == 0;
+}
+
+// A pooled file replaced by a rename with one of the same size is opened again, even within the same second
+bool testFilePoolReplaced() {
+	const char* filename = "saved_pool.tif";
+	const char* tmp_filename = "saved_pool_tmp.tif";
+	const int w = 16, h = 8;
+	std::vector< uint8_t > first(w * h, 1), second(w * h, 2), read(w * h);
+	MiniTiff::FileHandlePool pool(4);
+	if (!MiniTiff::save(filename, w, h, 1, 8, first.data()) || !pool.loadRegion(filename, 0, 0, w, h, read.data()) || read != first)
+		return false;
+	if (!MiniTiff::save(tmp_filename, w, h, 1, 8, second.data()) || rename(tmp_filename, filename) != 0)
+		return false;
+	return pool.loadRegion(filename, 0, 0, w, h, read.data()) && read == second && pool.num_misses == 2;
+}
+
+// A PackBits RGB image in strips of 5 rows, so the tiles of the cache overlap several strips
+bool saveRegionStrips(const char* ofilename) {
+	const int w = 45, h = 37;
+	std::vector< uint8_t > pixels(w * h * 3);
+	for (size_t i = 0; i < pixels.size(); ++i)
+		pixels[i] = (uint8_t)((i / 7) * 13);
+	MiniTiff::ScanlineWriter writer;
+	writer.compression = MiniTiff::Compression_PackBits;
+	writer.rows_per_strip = 5;
+	return writer.create(ofilename, w, h, 3, 8) && writer.writeRows(pixels.data(), h) && writer.close();
+}
+
+// Reads all the tiles of the image twice through a cache, comparing them with the full image
+bool testTileCache(const char* filename) {
+
+	std::vector< uint8_t > full;
+	int iw = 0, ih = 0, bytes_per_pixel = 0;
+	bool is_ok = MiniTiff::load(filename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+		iw = w;
+		ih = h;
+		bytes_per_pixel = num_comps * bits_per_comp / 8;
+		full.resize(w * h * bytes_per_pixel);
+		return f.readImage(full.data());
+		});
+	if (!is_ok)
+		return false;
+
+	const int tile_size = 16;
+	MiniTiff::TileCache cache(1 << 20, 4);
+	MiniTiff::TiffDecoder decoder;
+	MiniTiff::FileHandlePool pool(4);
+	// First with a decoder, then with a clean cache and a pool of open files
+	for (int pass = 0; pass < 4; ++pass) {
+		if (pass == 2)
+			cache.clear();
+		for (int ty = 0; ty * tile_size < ih; ++ty) {
+			for (int tx = 0; tx * tile_size < iw; ++tx) {
+				MiniTiff::TileCache::Tile tile = (pass < 2)
+					? cache.getTile(decoder, filename, 1, tx, ty, tile_size, tile_size)
+					: cache.getTile(pool, filename, 1, tx, ty, tile_size, tile_size);
+				if (!tile)
+					return false;
+				int w = std::min(tile_size, iw - tx * tile_size);
+				int h = std::min(tile_size, ih - ty * tile_size);
+				for (int y = 0; y < h; ++y) {
+					const uint8_t* src = full.data() + ((ty * tile_size + y) * iw + tx * tile_size) * bytes_per_pixel;
+					if (memcmp(src, tile->data() + y * w * bytes_per_pixel, w * bytes_per_pixel) != 0) {
+						printf("%s : tile %d,%d doesn't match\n", filename, tx, ty);
+						return false;
+					}
+				}
+			}
+		}
+	}
+	// The second pass of each mode must come from the cache, and the file opened only once
+	return cache.num_hits == cache.num_misses && pool.num_misses == 1;
+}
+
+// Saves floats as halfs and loads them back as floats. Big images are converted in several
+// blocks of rows, the last one partial, and the metadata must follow the last block
+bool testHalf(int w, int h) {
+	const char* ofilename = "saved_half.tif";
+	const int num_comps = 3;
+	std::vector< float > src(w * h * num_comps);
+	for (size_t i = 0; i < src.size(); ++i)
+		src[i] = ((float)(i % 4096) - 2048.0f) / 64.0f;	// All exact in half precision
+	src[0] = 65504.0f;		// Max half
+	src[1] = 1.0f / 16777216.0f;	// Min denormal half
+	MiniTiff::SaveOptions options;
+	options.software = "mini_tiff saveHalf";
+	if (!MiniTiff::saveHalf(ofilename, w, h, num_comps, src.data(), options))
+		return false;
+
+	MiniTiff::ImageInfo info = MiniTiff::probe(ofilename);
+	if (info.bits_per_component != 16 || info.sample_format != MiniTiff::SampleFormat_Float)
+		return false;
+	FILE* f = fopen(ofilename, "rb");
+	long file_size = -1;
+	if (f && fseek(f, 0, SEEK_END) == 0)
+		file_size = ftell(f);
+	if (f)
+		fclose(f);
+	if (file_size != (long)(info.offset_for_data + (size_t)w * h * num_comps * 2 + strlen(options.software) + 1))
+		return false;
+
+	std::vector< float > dst;
+	bool is_ok = MiniTiff::load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+		if (bits_per_comp != 16 || f.info.sample_format != MiniTiff::SampleFormat_Float)
+			return false;
+		const char* software = f.ifd.text(MiniTiff::IFD_Software);
+		if (!software || strcmp(software, options.software) != 0)
+			return false;
+		dst.resize(w * h * num_comps);
+		return f.readHalfAsFloat(dst.data(), dst.size());
+		});
+	return is_ok && dst == src;
+}
+
+// Round trip of signed ints and doubles
+template< typename T >
+bool testSampleFormat(uint16_t sample_format) {
+	const char* ofilename = "saved_sample_format.tif";
+	const int w = 13, h = 7, num_comps = 3;
+	std::vector< T > src(w * h * num_comps);
+	for (size_t i = 0; i < src.size(); ++i)
+		src[i] = (T)((int)i - 100) * (T)3;
+	MiniTiff::SaveOptions options;
+	options.sample_format = sample_format;
+	if (!MiniTiff::save(ofilename, w, h, num_comps, sizeof(T) * 8, src.data(), options))
+		return false;
+
+	std::vector< T > dst;
+	bool is_ok = MiniTiff::load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+		if (bits_per_comp != sizeof(T) * 8 || f.info.sample_format != sample_format)
+			return false;
+		dst.resize(w * h * num_comps);
+		return f.readBytes(dst.data(), dst.size() * sizeof(T));
+		});
+	return is_ok && dst == src;
+}
+
+// Components of 1, 2, 4 and 12 bits are packed when saving, and unpacked when loading
+template< typename T >
+bool testPacked(int bits_per_comp, int w, int h, int num_comps) {
+	const char* ofilename = "saved_packed.tif";
+	std::vector< T > src(w * h * num_comps);
+	uint32_t x = 1;
+	for (size_t i = 0; i < src.size(); ++i) {
+		x = x * 1103515245 + 12345;
+		src[i] = (T)((x >> 16) & ((1 << bits_per_comp) - 1));
+	}
+	if (!MiniTiff::save(ofilename, w, h, num_comps, bits_per_comp, src.data()))
+		return false;
+
+	MiniTiff::ImageInfo info = MiniTiff::probe(ofilename);
+	if (info.total_data_bytes != (uint32_t)((w * num_comps * bits_per_comp + 7) / 8 * h))
+		return false;
+
+	std::vector< T > dst;
+	bool is_ok = MiniTiff::load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+		dst.resize(w * h * num_comps);
+		return f.readUnpacked(dst.data());
+		});
+	// Regions are read by bytes, so they can't start in the middle of one
+	MiniTiff::TiffDecoder decoder;
+	std::vector< uint8_t > region(w * h * num_comps * 2);
+	if (decoder.loadRegion(ofilename, 0, 0, w, h, region.data()))
+		is_ok = false;
+	if (!is_ok || dst != src)
+		printf("Packed %d bits %dx%dx%d failed\n", bits_per_comp, w, h, num_comps);
+	return is_ok && dst == src;
+}
+
+// Writes a little endian tiff with the given entries and blocks of pixels. The entries with at_extra set
+// are offsets inside extra, which is stored after the IFD. The offsets and sizes of the blocks are added
+struct RawEntry {
+	uint16_t id, type;
+	uint32_t count, value;
+	bool at_extra;
+};
+
+bool saveRaw(const char* ofilename, std::vector< RawEntry > entries, std::vector< uint8_t > extra, const std::vector< std::vector< uint8_t > >& blocks, bool is_tiled = false) {
+	FILE* f = fopen(ofilename, "wb");
+	if (!f)
+		return false;
+	uint16_t num_entries = (uint16_t)entries.size() + 2;
+	uint32_t extra_at = 8 + 2 + num_entries * 12 + 4;
+	uint32_t num_blocks = (uint32_t)blocks.size();
+	uint16_t offsets_tag = is_tiled ? MiniTiff::IFD_TileOffsets : MiniTiff::IFD_OffsetForData;
+	uint16_t sizes_tag = is_tiled ? MiniTiff::IFD_TileByteCounts : MiniTiff::IFD_TotalBytesForData;
+	if (num_blocks == 1) {
+		uint32_t data_at = extra_at + (uint32_t)extra.size();
+		entries.push_back({ offsets_tag, 4, 1, data_at, false });
+		entries.push_back({ sizes_tag, 4, 1, (uint32_t)blocks[0].size(), false });
+	}
+	else {
+		// The arrays of offsets and sizes go at the end of extra
+		uint32_t offsets_at = (uint32_t)extra.size();
+		uint32_t data_at = extra_at + offsets_at + num_blocks * 8;
+		std::vector< uint32_t > arrays;
+		for (const auto& block : blocks) {
+			arrays.push_back(data_at);
+			data_at += (uint32_t)block.size();
+		}
+		for (const auto& block : blocks)
+			arrays.push_back((uint32_t)block.size());
+		extra.insert(extra.end(), (const uint8_t*)arrays.data(), (const uint8_t*)(arrays.data() + arrays.size()));
+		entries.push_back({ offsets_tag, 4, num_blocks, offsets_at, true });
+		entries.push_back({ sizes_tag, 4, num_blocks, offsets_at + num_blocks * 4, true });
+	}
+	std::sort(entries.begin(), entries.end(), [](const RawEntry& a, const RawEntry& b) { return a.id < b.id; });
+	uint32_t header[2] = { 0x002a4949, 8 };
+	uint32_t next_ifd = 0;
+	fwrite(header, 1, 8, f);
+	fwrite(&num_entries, 1, 2, f);
+	for (const RawEntry& e : entries) {
+		uint32_t value = e.at_extra ? extra_at + e.value : e.value;
+		fwrite(&e.id, 1, 2, f);
+		fwrite(&e.type, 1, 2, f);
+		fwrite(&e.count, 1, 4, f);
+		fwrite(&value, 1, 4, f);
+	}
+	fwrite(&next_ifd, 1, 4, f);
+	fwrite(extra.data(), 1, extra.size(), f);
+	for (const auto& block : blocks)
+		fwrite(block.data(), 1, block.size(), f);
+	fclose(f);
+	return true;
+}
+
+// Blocks of rows_per_strip rows for saveRaw, or a single one with all the rows when it's 0
+std::vector< std::vector< uint8_t > > splitRows(const std::vector< uint8_t >& pixels, size_t row_bytes, int rows_per_strip) {
+	if (rows_per_strip == 0)
+		return { pixels };
+	std::vector< std::vector< uint8_t > > strips;
+	size_t strip_bytes = row_bytes * rows_per_strip;
+	for (size_t at = 0; at < pixels.size(); at += strip_bytes)
+		strips.emplace_back(pixels.begin() + at, pixels.begin() + std::min(at + strip_bytes, pixels.size()));
+	return strips;
+}
+
+// save doesn't write palette images, so this writes a little endian one with 4 or 8 bits indices
+bool savePalette(const char* ofilename, int w, int h, int bits, const std::vector< uint8_t >& indices, const std::vector< uint16_t >& color_map, int rows_per_strip) {
+	uint32_t row_bytes = (w * bits + 7) / 8;
+	std::vector< uint8_t > pixels(row_bytes * h, 0);
+	for (int y = 0; y < h; ++y) {
+		uint8_t* row = pixels.data() + y * row_bytes;
+		for (int x = 0; x < w; ++x) {
+			uint8_t idx = indices[y * w + x];
+			if (bits == 8)
+				row[x] = idx;
+			else
+				row[x / 2] |= (x & 1) ? idx : idx << 4;
+		}
+	}
+	std::vector< uint8_t > extra((const uint8_t*)color_map.data(), (const uint8_t*)(color_map.data() + color_map.size()));
+	return saveRaw(ofilename, {
+		{ MiniTiff::IFD_Width, 4, 1, (uint32_t)w, false },
+		{ MiniTiff::IFD_Height, 4, 1, (uint32_t)h, false },
+		{ MiniTiff::IFD_BitsPerSample, 3, 1, (uint32_t)bits, false },
+		{ MiniTiff::IFD_Compression, 3, 1, 1, false },
+		{ MiniTiff::IFD_PhotometricInterpretation, 3, 1, 3, false },
+		{ MiniTiff::IFD_NumComponents, 3, 1, 1, false },
+		{ MiniTiff::IFD_RowsPerStrip, 4, 1, rows_per_strip ? (uint32_t)rows_per_strip : (uint32_t)h, false },
+		{ MiniTiff::IFD_ColorMap, 3, (uint32_t)color_map.size(), 0, true },
+		}, extra, splitRows(pixels, row_bytes, rows_per_strip));
+}
+
+// rows_per_strip 0 saves a single strip
+bool testPalette(int bits, int rows_per_strip) {
+	const char* ofilename = "saved_palette.tif";
+	const int w = 9, h = 5;
+	int num_colors = 1 << bits;
+	std::vector< uint16_t > color_map(3 * num_colors);
+	for (int i = 0; i < num_colors; ++i) {
+		color_map[i] = (uint16_t)(i * 257);
+		color_map[num_colors + i] = (uint16_t)(65535 - i * 100);
+		color_map[2 * num_colors + i] = (uint16_t)(i * 31 * 256);
+	}
+	std::vector< uint8_t > indices(w * h);
+	for (size_t i = 0; i < indices.size(); ++i)
+		indices[i] = (uint8_t)((i * 7) % num_colors);
+	if (!savePalette(ofilename, w, h, bits, indices, color_map, rows_per_strip))
+		return false;
+
+	std::vector< uint8_t > raw;
+	std::vector< uint8_t > rgba;
+	std::vector< uint16_t > rgb16;
+	for (int mode = 0; mode < 3; ++mode) {
+		bool is_ok = MiniTiff::load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+			if (mode == 0) {
+				raw.resize(w * h);
+				return f.readUnpacked(raw.data());
+			}
+			if (mode == 1) {
+				rgba.resize(w * h * 4);
+				return f.readPaletteRGB(rgba.data(), true);
+			}
+			rgb16.resize(w * h * 3);
+			return f.readPaletteRGB(rgb16.data());
+			});
+		if (!is_ok)
+			return false;
+	}
+	if (raw != indices)
+		return false;
+	for (size_t i = 0; i < indices.size(); ++i) {
+		int idx = indices[i];
+		for (int c = 0; c < 3; ++c) {
+			if (rgba[i * 4 + c] != color_map[c * num_colors + idx] >> 8 || rgb16[i * 3 + c] != color_map[c * num_colors + idx])
+				return false;
+		}
+		if (rgba[i * 4 + 3] != 255)
+			return false;
+	}
+	return true;
+}
+
+bool testCMYK(int rows_per_strip) {
+	const char* ofilename = "saved_cmyk.tif";
+	const int w = 7, h = 3;
+	std::vector< uint8_t > pixels(w * h * 4);
+	for (size_t i = 0; i < pixels.size(); ++i)
+		pixels[i] = (uint8_t)(i * 37);
+	bool is_ok = saveRaw(ofilename, {
+		{ MiniTiff::IFD_Width, 4, 1, (uint32_t)w, false },
+		{ MiniTiff::IFD_Height, 4, 1, (uint32_t)h, false },
+		{ MiniTiff::IFD_BitsPerSample, 3, 1, 8, false },
+		{ MiniTiff::IFD_Compression, 3, 1, 1, false },
+		{ MiniTiff::IFD_PhotometricInterpretation, 3, 1, 5, false },
+		{ MiniTiff::IFD_NumComponents, 3, 1, 4, false },
+		{ MiniTiff::IFD_RowsPerStrip, 4, 1, rows_per_strip ? (uint32_t)rows_per_strip : (uint32_t)h, false },
+		}, {}, splitRows(pixels, w * 4, rows_per_strip));
+	std::vector< uint8_t > rgb;
+	is_ok = is_ok && MiniTiff::load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+		rgb.resize(w * h * 3);
+		return f.readRGB(rgb.data());
+		});
+	if (!is_ok)
+		return false;
+	for (int i = 0; i < w * h; ++i) {
+		const uint8_t* cmyk = &pixels[i * 4];
+		for (int c = 0; c < 3; ++c) {
+			int expected = (int)((255 - cmyk[c]) * (255 - cmyk[3]) / 255.0 + 0.5);
+			if (rgb[i * 3 + c] != expected)
+				return false;
+		}
+	}
+	return true;
+}
+
+// Every data unit of sh x sv pixels has a single color, so the expected colors are exact, except for the rounding.
+// With several strips, each one has a row of units
+bool testYCbCr(int sh, int sv, bool by_strips) {
+	const char* ofilename = "saved_ycbcr.tif";
+	const int w = 11, h = 5;
+	int units_x = (w + sh - 1) / sh;
+	int units_y = (h + sv - 1) / sv;
+	std::vector< uint8_t > unit_rgb(units_x * units_y * 3);
+	for (size_t i = 0; i < unit_rgb.size(); ++i)
+		unit_rgb[i] = (uint8_t)(i * 53 + 17);
+	std::vector< uint8_t > pixels;
+	for (size_t u = 0; u < unit_rgb.size(); u += 3) {
+		float r = unit_rgb[u], g = unit_rgb[u + 1], b = unit_rgb[u + 2];
+		float y = 0.299f * r + 0.587f * g + 0.114f * b;
+		float cb = (b - y) / 1.772f + 128.0f;
+		float cr = (r - y) / 1.402f + 128.0f;
+		for (int k = 0; k < sh * sv; ++k)
+			pixels.push_back((uint8_t)(y + 0.5f));
+		pixels.push_back((uint8_t)(cb + 0.5f));
+		pixels.push_back((uint8_t)(cr + 0.5f));
+	}
+	// The default ReferenceBlackWhite, written to test the reading of rationals
+	uint32_t reference[12] = { 0, 1, 255, 1, 128, 1, 255, 1, 128, 1, 255, 1 };
+	std::vector< uint8_t > extra((const uint8_t*)reference, (const uint8_t*)(reference + 12));
+	bool is_ok = saveRaw(ofilename, {
+		{ MiniTiff::IFD_Width, 4, 1, (uint32_t)w, false },
+		{ MiniTiff::IFD_Height, 4, 1, (uint32_t)h, false },
+		{ MiniTiff::IFD_BitsPerSample, 3, 1, 8, false },
+		{ MiniTiff::IFD_Compression, 3, 1, 1, false },
+		{ MiniTiff::IFD_PhotometricInterpretation, 3, 1, 6, false },
+		{ MiniTiff::IFD_NumComponents, 3, 1, 3, false },
+		{ MiniTiff::IFD_YCbCrSubsampling, 3, 2, (uint32_t)(sh | (sv << 16)), false },
+		{ MiniTiff::IFD_RowsPerStrip, 4, 1, by_strips ? (uint32_t)sv : (uint32_t)h, false },
+		{ MiniTiff::IFD_ReferenceBlackWhite, 5, 6, 0, true },
+		}, extra, splitRows(pixels, units_x * (sh * sv + 2), by_strips ? 1 : 0));
+	std::vector< uint8_t > rgba;
+	is_ok = is_ok && MiniTiff::load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+		rgba.resize(w * h * 4);
+		return f.readRGB(rgba.data(), true);
+		});
+	if (!is_ok)
+		return false;
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			const uint8_t* expected = &unit_rgb[((y / sv) * units_x + x / sh) * 3];
+			const uint8_t* rgb = &rgba[(y * w + x) * 4];
+			for (int c = 0; c < 3; ++c)
+				if (abs(rgb[c] - expected[c]) > 2)
+					return false;
+			if (rgb[3] != 255)
+				return false;
+		}
+	}
+	return true;
+}
+
+// Runs of 3 or more equal bytes are repeated, the rest are copied. Each row is encoded on its own
+static void packBitsRows(const uint8_t* src, size_t row_bytes, int num_rows, std::vector< uint8_t >& out) {
+	for (int y = 0; y < num_rows; ++y, src += row_bytes) {
+		size_t i = 0;
+		while (i < row_bytes) {
+			size_t run = 1;
+			while (i + run < row_bytes && run < 128 && src[i + run] == src[i])
+				++run;
+			if (run >= 3) {
+				out.push_back((uint8_t)(1 - (int)run));
+				out.push_back(src[i]);
+				i += run;
+				continue;
+			}
+			size_t n = 1;
+			while (i + n < row_bytes && n < 128 && !(i + n + 2 < row_bytes && src[i + n] == src[i + n + 1] && src[i + n] == src[i + n + 2]))
+				++n;
+			out.push_back((uint8_t)(n - 1));
+			out.insert(out.end(), src + i, src + i + n);
+			i += n;
+		}
+	}
+}
+
+// Reads an image with readImage, and checks the pixels are the expected ones, +- tolerance
+static bool loadBlocks(const char* ofilename, const std::vector< uint8_t >& expected, int tolerance) {
+	std::vector< uint8_t > pixels(expected.size());
+	bool is_ok = MiniTiff::load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+		// The pixels are not contiguous in the file
+		if (f.readBytes(pixels.data(), pixels.size()))
+			return false;
+		return f.readImage(pixels.data(), 3);
+		});
+	if (!is_ok)
+		return false;
+	for (size_t i = 0; i < expected.size(); ++i)
+		if (abs(pixels[i] - expected[i]) > tolerance)
+			return false;
+	return true;
+}
+
+#ifdef MINI_TIFF_JPEG
+// Each tile is an abbreviated JPEG, and the tables are stored once
+static void compressJPEGTiles(const std::vector< uint8_t >& rgb, int w, int h, int tw, int th, std::vector< uint8_t >& tables, std::vector< std::vector< uint8_t > >& tiles) {
+	jpeg_compress_struct cinfo;
+	jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	cinfo.image_width = tw;
+	cinfo.image_height = th;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, 95, TRUE);
+	cinfo.write_JFIF_header = FALSE;
+
+	unsigned char* mem = nullptr;
+	unsigned long mem_size = 0;
+	jpeg_mem_dest(&cinfo, &mem, &mem_size);
+	jpeg_write_tables(&cinfo);
+	tables.assign(mem, mem + mem_size);
+	free(mem);
+
+	std::vector< uint8_t > tile(tw * th * 3);
+	for (int ty = 0; ty < h; ty += th) {
+		for (int tx = 0; tx < w; tx += tw) {
+			// Tiles on the borders repeat the last pixel
+			for (int y = 0; y < th; ++y)
+				for (int x = 0; x < tw; ++x)
+					memcpy(&tile[(y * tw + x) * 3], &rgb[((std::min(ty + y, h - 1)) * w + std::min(tx + x, w - 1)) * 3], 3);
+			mem = nullptr;
+			mem_size = 0;
+			jpeg_mem_dest(&cinfo, &mem, &mem_size);
+			jpeg_start_compress(&cinfo, FALSE);
+			while (cinfo.next_scanline < cinfo.image_height) {
+				JSAMPROW row = &tile[cinfo.next_scanline * tw * 3];
+				jpeg_write_scanlines(&cinfo, &row, 1);
+			}
+			jpeg_finish_compress(&cinfo);
+			tiles.emplace_back(mem, mem + mem_size);
+			free(mem);
+		}
+	}
+	jpeg_destroy_compress(&cinfo);
+}
+#endif
+
+// Tiled, multi strip and compressed images, read with readImage
+bool testBlocks() {
+	const char* ofilename = "saved_blocks.tif";
+
+	// Uncompressed tiles of RGB 16 bits
+	{
+		const int w = 37, h = 21, tw = 16, th = 16;
+		std::vector< uint16_t > rgb(w * h * 3);
+		for (size_t i = 0; i < rgb.size(); ++i)
+			rgb[i] = (uint16_t)(i * 1237);
+		std::vector< std::vector< uint8_t > > tiles;
+		for (int ty = 0; ty < h; ty += th) {
+			for (int tx = 0; tx < w; tx += tw) {
+				std::vector< uint8_t > tile(tw * th * 6, 0);
+				for (int y = ty; y < std::min(ty + th, h); ++y)
+					for (int x = tx; x < std::min(tx + tw, w); ++x)
+						memcpy(&tile[((y - ty) * tw + x - tx) * 6], &rgb[(y * w + x) * 3], 6);
+				tiles.push_back(tile);
+			}
+		}
+		bool is_ok = saveRaw(ofilename, {
+			{ MiniTiff::IFD_Width, 4, 1, (uint32_t)w, false },
+			{ MiniTiff::IFD_Height, 4, 1, (uint32_t)h, false },
+			{ MiniTiff::IFD_BitsPerSample, 3, 1, 16, false },
+			{ MiniTiff::IFD_Compression, 3, 1, MiniTiff::Compression_None, false },
+			{ MiniTiff::IFD_PhotometricInterpretation, 3, 1, 2, false },
+			{ MiniTiff::IFD_NumComponents, 3, 1, 3, false },
+			{ MiniTiff::IFD_TileWidth, 3, 1, (uint32_t)tw, false },
+			{ MiniTiff::IFD_TileLength, 3, 1, (uint32_t)th, false },
+			}, {}, tiles, true);
+		std::vector< uint8_t > expected((const uint8_t*)rgb.data(), (const uint8_t*)(rgb.data() + rgb.size()));
+		if (!is_ok || !loadBlocks(ofilename, expected, 0))
+			return false;
+	}
+
+	// Strips of 4 rows compressed with PackBits
+	{
+		const int w = 29, h = 11, rows_per_strip = 4;
+		std::vector< uint8_t > grey(w * h);
+		for (size_t i = 0; i < grey.size(); ++i)
+			grey[i] = (uint8_t)((i % 7 < 4) ? 200 : i * 13);
+		std::vector< std::vector< uint8_t > > strips;
+		for (int y = 0; y < h; y += rows_per_strip) {
+			strips.emplace_back();
+			packBitsRows(&grey[y * w], w, std::min(rows_per_strip, h - y), strips.back());
+		}
+		bool is_ok = saveRaw(ofilename, {
+			{ MiniTiff::IFD_Width, 4, 1, (uint32_t)w, false },
+			{ MiniTiff::IFD_Height, 4, 1, (uint32_t)h, false },
+			{ MiniTiff::IFD_BitsPerSample, 3, 1, 8, false },
+			{ MiniTiff::IFD_Compression, 3, 1, MiniTiff::Compression_PackBits, false },
+			{ MiniTiff::IFD_PhotometricInterpretation, 3, 1, 1, false },
+			{ MiniTiff::IFD_NumComponents, 3, 1, 1, false },
+			{ MiniTiff::IFD_RowsPerStrip, 4, 1, (uint32_t)rows_per_strip, false },
+			}, {}, strips);
+		if (!is_ok || !loadBlocks(ofilename, grey, 0))
+			return false;
+	}
+
+#ifdef MINI_TIFF_JPEG
+	// YCbCr JPEG tiles sharing the JPEGTables
+	{
+		const int w = 50, h = 40, tw = 32, th = 16;
+		std::vector< uint8_t > rgb(w * h * 3);
+		for (int y = 0; y < h; ++y) {
+			for (int x = 0; x < w; ++x) {
+				rgb[(y * w + x) * 3 + 0] = (uint8_t)(x * 4);
+				rgb[(y * w + x) * 3 + 1] = (uint8_t)(y * 5);
+				rgb[(y * w + x) * 3 + 2] = 128;
+			}
+		}
+		std::vector< uint8_t > tables;
+		std::vector< std::vector< uint8_t > > tiles;
+		compressJPEGTiles(rgb, w, h, tw, th, tables, tiles);
+		bool is_ok = saveRaw(ofilename, {
+			{ MiniTiff::IFD_Width, 4, 1, (uint32_t)w, false },
+			{ MiniTiff::IFD_Height, 4, 1, (uint32_t)h, false },
+			{ MiniTiff::IFD_BitsPerSample, 3, 1, 8, false },
+			{ MiniTiff::IFD_Compression, 3, 1, MiniTiff::Compression_JPEG, false },
+			{ MiniTiff::IFD_PhotometricInterpretation, 3, 1, 6, false },
+			{ MiniTiff::IFD_NumComponents, 3, 1, 3, false },
+			{ MiniTiff::IFD_TileWidth, 3, 1, (uint32_t)tw, false },
+			{ MiniTiff::IFD_TileLength, 3, 1, (uint32_t)th, false },
+			{ MiniTiff::IFD_JPEGTables, 7, (uint32_t)tables.size(), 0, true },
+			}, tables, tiles, true);
+		if (!is_ok || !loadBlocks(ofilename, rgb, 10))
+			return false;
+	}
+#endif
+	return true;
+}
+
+// Saves the same pixels with each orientation, and checks they are loaded rotated/flipped
+bool testOrientation() {
+	const char* ofilename = "saved_orientation.tif";
+	const int w = 19, h = 7;
+	for (int orientation = 1; orientation <= 8; ++orientation) {
+		// Odd orientations are a single strip of RGB 8 bits, even ones strips of 3 rows of grey 16 bits
+		int num_comps = (orientation & 1) ? 3 : 1;
+		int bits = (orientation & 1) ? 8 : 16;
+		size_t pixel_bytes = num_comps * bits / 8;
+		int rows_per_strip = (orientation & 1) ? h : 3;
+		std::vector< uint8_t > pixels(w * h * pixel_bytes);
+		for (size_t i = 0; i < pixels.size(); ++i)
+			pixels[i] = (uint8_t)(i * 7 + i / 251);
+		std::vector< std::vector< uint8_t > > strips;
+		for (int y = 0; y < h; y += rows_per_strip)
+			strips.emplace_back(&pixels[y * w * pixel_bytes], &pixels[std::min(y + rows_per_strip, h) * w * pixel_bytes]);
+		if (!saveRaw(ofilename, {
+			{ MiniTiff::IFD_Width, 4, 1, (uint32_t)w, false },
+			{ MiniTiff::IFD_Height, 4, 1, (uint32_t)h, false },
+			{ MiniTiff::IFD_BitsPerSample, 3, 1, (uint32_t)bits, false },
+			{ MiniTiff::IFD_Compression, 3, 1, 1, false },
+			{ MiniTiff::IFD_PhotometricInterpretation, 3, 1, num_comps == 1 ? 1u : 2u, false },
+			{ MiniTiff::IFD_Orientation, 3, 1, (uint32_t)orientation, false },
+			{ MiniTiff::IFD_NumComponents, 3, 1, (uint32_t)num_comps, false },
+			{ MiniTiff::IFD_RowsPerStrip, 4, 1, (uint32_t)rows_per_strip, false },
+			}, {}, strips))
+			return false;
+
+		// Where each pixel of the file must be
+		bool is_transposed = orientation >= 5;
+		int ow = is_transposed ? h : w;
+		int oh = is_transposed ? w : h;
+		std::vector< uint8_t > expected(pixels.size());
+		for (int y = 0; y < h; ++y) {
+			for (int x = 0; x < w; ++x) {
+				int ox = x, oy = y;
+				switch (orientation) {
+				case 2: ox = w - 1 - x; break;
+				case 3: ox = w - 1 - x; oy = h - 1 - y; break;
+				case 4: oy = h - 1 - y; break;
+				case 5: ox = y; oy = x; break;
+				case 6: ox = h - 1 - y; oy = x; break;
+				case 7: ox = h - 1 - y; oy = w - 1 - x; break;
+				case 8: ox = y; oy = w - 1 - x; break;
+				}
+				memcpy(&expected[(oy * ow + ox) * pixel_bytes], &pixels[(y * w + x) * pixel_bytes], pixel_bytes);
+			}
+		}
+
+		MiniTiff::TiffDecoder decoder;
+		decoder.apply_orientation = true;
+		std::vector< uint8_t > oriented;
+		bool is_ok = decoder.load(ofilename, [&](int lw, int lh, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+			if (lw != ow || lh != oh)
+				return false;
+			oriented.resize(lw * lh * pixel_bytes);
+			// Only readImage applies the orientation
+			if (orientation != 1 && f.readBytes(oriented.data(), oriented.size()))
+				return false;
+			return f.readImage(oriented.data(), 2);
+			});
+		if (!is_ok || oriented != expected)
+			return false;
+	}
+	return true;
+}
+
+// Writes images giving the rows in several calls, and reads them back
+template< typename T >
+bool testScanlineWriter(int w, int h, int num_comps, int bits, uint16_t compression, uint32_t rows_per_strip) {
+	const char* ofilename = "saved_scanlines.tif";
+	size_t values_per_row = w * num_comps;
+	std::vector< T > pixels(values_per_row * h);
+	uint32_t max_value = bits < 16 ? (1u << bits) - 1 : 0xffffu;
+	for (size_t i = 0; i < pixels.size(); ++i)
+		pixels[i] = (T)(((i % 5) < 3 ? 7 : i * 31) & max_value);
+
+	MiniTiff::ScanlineWriter writer;
+	writer.compression = compression;
+	writer.rows_per_strip = rows_per_strip;
+	if (!writer.create(ofilename, w, h, num_comps, bits))
+		return false;
+	int y = 0;
+	for (int n : { 1, 5, 2, h }) {
+		n = std::min(n, h - y);
+		if (!writer.writeRows(&pixels[y * values_per_row], n))
+			return false;
+		y += n;
+	}
+	if (!writer.close())
+		return false;
+
+	// Packed components are read as they are in the file
+	size_t row_bytes = (values_per_row * bits + 7) / 8;
+	std::vector< uint8_t > expected(row_bytes * h, 0);
+	if (bits < 8) {
+		for (int r = 0; r < h; ++r)
+			for (size_t i = 0; i < values_per_row; ++i)
+				expected[r * row_bytes + i * bits / 8] |= (uint8_t)(pixels[r * values_per_row + i] << (8 - bits - (i * bits) % 8));
+	}
+	else {
+		memcpy(expected.data(), pixels.data(), expected.size());
+	}
+	// The same decoder reads all the files, reusing its threads
+	static MiniTiff::TiffDecoder decoder;
+	std::vector< uint8_t > loaded(expected.size());
+	bool is_ok = decoder.load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+		return f.readImage(loaded.data(), 3);
+		});
+	return is_ok && loaded == expected;
+}
+
+// The conversions read any layout: packed and half values from several strips, compressed or not, and halfs from tiles
+bool testConvertedBlocks() {
+	const char* ofilename = "saved_converted_blocks.tif";
+	const int w = 64, h = 32, tile_size = 16;
+	std::vector< uint8_t > mask(w * h);
+	std::vector< uint16_t > values12(w * h);
+	for (size_t i = 0; i < mask.size(); ++i) {
+		mask[i] = (uint8_t)((i * 7 / 3) & 1);
+		values12[i] = (uint16_t)((i * 331) & 0xfff);
+	}
+	std::vector< float > floats(w * h * 3);
+	std::vector< uint16_t > halfs(floats.size());
+	for (size_t i = 0; i < floats.size(); ++i) {
+		floats[i] = ((float)(i % 64) - 32.0f) / 4.0f;
+		halfs[i] = MiniTiff::internal::floatToHalf(floats[i]);
+	}
+	MiniTiff::SaveOptions half_options;
+	half_options.sample_format = MiniTiff::SampleFormat_Float;
+
+	for (uint16_t compression : { MiniTiff::Compression_None, MiniTiff::Compression_PackBits }) {
+		MiniTiff::ScanlineWriter writer;
+		writer.compression = compression;
+		writer.rows_per_strip = 8;
+		std::vector< uint8_t > mask_read(mask.size());
+		if (!writer.create(ofilename, w, h, 1, 1) || !writer.writeRows(mask.data(), h) || !writer.close())
+			return false;
+		if (!MiniTiff::load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) { return f.readUnpacked(mask_read.data()); }) || mask_read != mask)
+			return false;
+		std::vector< uint16_t > values12_read(values12.size());
+		if (!writer.create(ofilename, w, h, 1, 12) || !writer.writeRows(values12.data(), h) || !writer.close())
+			return false;
+		if (!MiniTiff::load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) { return f.readUnpacked(values12_read.data()); }) || values12_read != values12)
+			return false;
+		std::vector< float > floats_read(floats.size());
+		if (!writer.create(ofilename, w, h, 3, 16, half_options) || !writer.writeRows(halfs.data(), h) || !writer.close())
+			return false;
+		if (!MiniTiff::load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) { return f.readHalfAsFloat(floats_read.data(), floats_read.size()); }) || floats_read != floats)
+			return false;
+	}
+
+	MiniTiff::TileWriter tile_writer;
+	if (!tile_writer.create(ofilename, w, h, 3, 16, tile_size, tile_size, half_options))
+		return false;
+	std::vector< uint16_t > tile(tile_size * tile_size * 3);
+	for (int ty = 0; ty < h / tile_size; ++ty)
+		for (int tx = 0; tx < w / tile_size; ++tx) {
+			for (int y = 0; y < tile_size; ++y)
+				memcpy(&tile[y * tile_size * 3], &halfs[((ty * tile_size + y) * w + tx * tile_size) * 3], tile_size * 3 * sizeof(uint16_t));
+			if (!tile_writer.writeTile(tx, ty, tile.data()))
+				return false;
+		}
+	std::vector< float > floats_read(floats.size());
+	if (!tile_writer.close())
+		return false;
+	return MiniTiff::load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) { return f.readHalfAsFloat(floats_read.data(), floats_read.size()); }) && floats_read == floats;
+}
+
+// Several threads write the tiles in reverse order
+bool testTileWriter(int w, int h, uint16_t compression) {
+	const char* ofilename = "saved_tiles.tif";
+	const int tile_w = 16, tile_h = 16, num_comps = 3;
+	std::vector< uint16_t > rgb(w * h * num_comps);
+	for (size_t i = 0; i < rgb.size(); ++i)
+		rgb[i] = (uint16_t)((i % 11) < 6 ? 1000 : i * 977);
+
+	MiniTiff::TileWriter writer;
+	writer.compression = compression;
+	if (!writer.create(ofilename, w, h, num_comps, 16, tile_w, tile_h))
+		return false;
+	int tiles_x = (w + tile_w - 1) / tile_w;
+	int num_tiles = tiles_x * ((h + tile_h - 1) / tile_h);
+	const int num_threads = 3;
+	std::atomic< int > num_failed(0);
+	std::vector< std::thread > threads;
+	for (int t = 0; t < num_threads; ++t) {
+		threads.emplace_back([&, t]() {
+			std::vector< uint16_t > tile(tile_w * tile_h * num_comps, 0);
+			for (int i = num_tiles - 1 - t; i >= 0; i -= num_threads) {
+				int tx = i % tiles_x, ty = i / tiles_x;
+				for (int y = 0; y < tile_h; ++y)
+					for (int x = 0; x < tile_w; ++x)
+						for (int c = 0; c < num_comps; ++c) {
+							int sx = std::min(tx * tile_w + x, w - 1), sy = std::min(ty * tile_h + y, h - 1);
+							tile[(y * tile_w + x) * num_comps + c] = rgb[(sy * w + sx) * num_comps + c];
+						}
+				if (!writer.writeTile(tx, ty, tile.data()))
+					++num_failed;
+			}
+			});
+	}
+	for (auto& t : threads)
+		t.join();
+	// Each tile can only be written once
+	std::vector< uint16_t > tile(tile_w * tile_h * num_comps, 0);
+	if (num_failed != 0 || writer.writeTile(0, 0, tile.data()) || !writer.close())
+		return false;
+
+	std::vector< uint16_t > loaded(rgb.size());
+	bool is_ok = MiniTiff::load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+		return f.readImage(loaded.data());
+		});
+	return is_ok && loaded == rgb;
+}
+
+// The transcoded files must have the same pixels as the original
+bool testTranscode(const char* ifilename) {
+	const char* ofilename = "saved_transcoded.tif";
+	std::vector< uint8_t > original;
+	auto readAll = [](const char* filename, std::vector< uint8_t >& pixels) {
+		return MiniTiff::load(filename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+			pixels.resize(((size_t)w * num_comps * bits_per_comp + 7) / 8 * h);
+			return f.readImage(pixels.data());
+			});
+	};
+	if (!readAll(ifilename, original))
+		return false;
+	// The second time each compression is kept, and the blocks copied as they are
+	for (uint16_t compression : { MiniTiff::Compression_PackBits, MiniTiff::Compression_PackBits, MiniTiff::Compression_None, MiniTiff::Compression_None }) {
+		MiniTiff::TranscodeOptions options;
+		options.compression = compression;
+		options.num_threads = 2;
+		std::vector< uint8_t > transcoded;
+		if (!MiniTiff::transcode(ifilename, ofilename, options) || !readAll(ofilename, transcoded) || transcoded != original)
+			return false;
+		MiniTiff::ImageInfo info = MiniTiff::probe(ofilename);
+		if (info.big_endian || info.compression != compression)
+			return false;
+		// Each pass starts from the previous output
+		ifilename = "saved_transcoded_src.tif";
+		remove(ifilename);
+		if (rename(ofilename, ifilename) != 0)
+			return false;
+	}
+	return true;
+}
+
+// A tiled float image with an orientation has the most entries in the IFD written by transcode
+bool testTranscodeFloatTiles() {
+	const char* ifilename = "saved_float_tiles.tif";
+	const char* ofilename = "saved_float_tiles_transcoded.tif";
+	const int w = 64, h = 48, tile_w = 16, tile_h = 16;
+	MiniTiff::TileWriter writer;
+	if (!writer.create(ifilename, w, h, 1, 32, tile_w, tile_h))
+		return false;
+	std::vector< float > tile(tile_w * tile_h);
+	for (int ty = 0; ty < h / tile_h; ++ty)
+		for (int tx = 0; tx < w / tile_w; ++tx) {
+			for (int i = 0; i < tile_w * tile_h; ++i)
+				tile[i] = (tx * tile_w + i % tile_w) * 0.5f - (ty * tile_h + i / tile_w);
+			if (!writer.writeTile(tx, ty, tile.data()))
+				return false;
+		}
+	uint16_t orientation = 6;
+	MiniTiff::TagValue tag(MiniTiff::IFD_Orientation, 3, 1, &orientation);
+	if (!writer.close() || !MiniTiff::updateTags(ifilename, &tag, 1))
+		return false;
+	MiniTiff::TranscodeOptions options;
+	options.compression = MiniTiff::Compression_PackBits;
+	if (!MiniTiff::transcode(ifilename, ofilename, options))
+		return false;
+	MiniTiff::ImageInfo info = MiniTiff::probe(ofilename);
+	if (info.sample_format != MiniTiff::SampleFormat_Float || info.orientation != 6 || info.tile_w != tile_w)
+		return false;
+	std::vector< float > pixels[2];
+	const char* filenames[2] = { ifilename, ofilename };
+	for (int i = 0; i < 2; ++i) {
+		bool is_ok = MiniTiff::load(filenames[i], [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+			pixels[i].resize((size_t)w * h * num_comps);
+			return bits_per_comp == 32 && f.readImage(pixels[i].data());
+			});
+		if (!is_ok)
+			return false;
+	}
+	return pixels[0] == pixels[1];
+}
+
+// Text of a tag stored out of the entry, "" when missing
+std::string readTextTag(const char* filename, uint16_t tag_id) {
+	std::string text;
+	uint32_t at = 0;
+	uint32_t count = 0;
+	MiniTiff::info(filename, [&](uint16_t id, uint32_t value, uint32_t value_type, uint32_t num_elems) {
+		if (id == tag_id && value_type == 2 && num_elems > 4) {
+			at = value;
+			count = num_elems;
+		}
+		});
+	FILE* f = fopen(filename, "rb");
+	if (f && at) {
+		text.resize(count);
+		if (fseek(f, at, SEEK_SET) != 0 || fread(&text[0], 1, count, f) != count)
+			text.clear();
+		else
+			text.resize(strlen(text.c_str()));
+	}
+	if (f)
+		fclose(f);
+	return text;
+}
+
+// Tags are added appending a new IFD, then replaced in place. The pixels must not change
+bool testUpdateTags(const char* ifilename) {
+	const char* filename = "saved_update_tags.tif";
+	std::vector< uint8_t > pixels[2];
+	MiniTiff::ImageInfo info = MiniTiff::probe(ifilename);
+	MiniTiff::TranscodeOptions options;
+	options.compression = info.compression;
+	// Same layout and byte order when the file is little endian. The big endian one is copied as is
+	if (info.big_endian) {
+		FILE* src = fopen(ifilename, "rb");
+		FILE* dst = fopen(filename, "wb");
+		char buf[4096];
+		size_t n;
+		while (src && dst && (n = fread(buf, 1, sizeof(buf), src)) > 0)
+			fwrite(buf, 1, n, dst);
+		if (src) fclose(src);
+		if (dst) fclose(dst);
+	}
+	else if (!MiniTiff::transcode(ifilename, filename, options))
+		return false;
+	auto readAll = [&](std::vector< uint8_t >& dst) {
+		return MiniTiff::load(filename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+			dst.resize(((size_t)w * num_comps * bits_per_comp + 7) / 8 * h);
+			return f.readImage(dst.data());
+			});
+	};
+	if (!readAll(pixels[0]))
+		return false;
+
+	// A private tag is not in any of the files, so the IFD grows and is appended
+	uint32_t resolution[2] = { 300, 1 };
+	uint16_t unit = 2;
+	uint32_t custom[3] = { 1, 2, 3 };
+	MiniTiff::TagValue tags[] = {
+		MiniTiff::TagValue::text(MiniTiff::IFD_Software, "mini_tiff updateTags test"),
+		MiniTiff::TagValue(MiniTiff::IFD_XResolution, 5, 1, resolution),
+		MiniTiff::TagValue(MiniTiff::IFD_ResolutionUnits, 3, 1, &unit),
+		MiniTiff::TagValue(0xC350, 4, 3, custom),
+	};
+	if (!MiniTiff::updateTags(filename, tags, 4))
+		return false;
+	MiniTiff::ImageInfo appended = MiniTiff::probe(filename);
+	if (appended.offset_first_ifd == info.offset_first_ifd || readTextTag(filename, MiniTiff::IFD_Software) != "mini_tiff updateTags test")
+		return false;
+
+	// A shorter text fits where the old one was
+	MiniTiff::TagValue shorter = MiniTiff::TagValue::text(MiniTiff::IFD_Software, "mini_tiff");
+	if (!MiniTiff::updateTags(filename, &shorter, 1))
+		return false;
+	bool has_unit = false;
+	MiniTiff::info(filename, [&](uint16_t id, uint32_t value, uint32_t value_type, uint32_t num_elems) {
+		has_unit |= id == MiniTiff::IFD_ResolutionUnits && value == 2;
+		});
+	MiniTiff::ImageInfo updated = MiniTiff::probe(filename);
+	if (updated.offset_first_ifd != appended.offset_first_ifd || !has_unit || readTextTag(filename, MiniTiff::IFD_Software) != "mini_tiff")
+		return false;
+
+	// Removed, also in place
+	MiniTiff::TagValue removed(MiniTiff::IFD_Software, 2, 0, nullptr);
+	if (!MiniTiff::updateTags(filename, &removed, 1) || !readTextTag(filename, MiniTiff::IFD_Software).empty())
+		return false;
+	return readAll(pixels[1]) && pixels[0] == pixels[1] && MiniTiff::probe(filename).big_endian == info.big_endian;
+}
+
+// Arrays of the IFD are read with it, in native byte order
+bool testIFD() {
+	bool is_ok = MiniTiff::load("RGB_32x32_16b_BE.tif", [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+		uint32_t n = 0;
+		const uint16_t* bits = f.ifd.shorts(MiniTiff::IFD_BitsPerSample, &n);
+		float resolution = 0.0f;
+		if (!bits || n != (uint32_t)num_comps || !f.ifd.rationals(MiniTiff::IFD_XResolution, &resolution, 1) || resolution <= 0.0f)
+			return false;
+		for (uint32_t i = 0; i < n; ++i)
+			if (bits[i] != 16)
+				return false;
+		// ICC profiles have their signature at byte 36
+		std::vector< uint8_t > icc;
+		if (!f.readBlob(MiniTiff::IFD_ICCProfile, icc) || icc.size() < 40 || memcmp(icc.data() + 36, "acsp", 4) != 0)
+			return false;
+		const char* software = f.ifd.text(MiniTiff::IFD_Software);
+		return software && strlen(software) + 1 == f.ifd.count(MiniTiff::IFD_Software)
+			&& f.ifd.get(MiniTiff::IFD_OffsetForData) == f.info.offset_for_data
+			&& f.ifd.get(MiniTiff::IFD_NumComponents) == (uint32_t)num_comps;
+		});
+	if (!is_ok)
+		return false;
+
+	// Components with different bits are not supported
+	const char* ofilename = "saved_mixed_bits.tif";
+	uint16_t bits[3] = { 8, 8, 16 };
+	std::vector< uint8_t > extra((const uint8_t*)bits, (const uint8_t*)(bits + 3));
+	if (!saveRaw(ofilename, {
+		{ MiniTiff::IFD_Width, 4, 1, 2, false },
+		{ MiniTiff::IFD_Height, 4, 1, 2, false },
+		{ MiniTiff::IFD_BitsPerSample, 3, 3, 0, true },
+		{ MiniTiff::IFD_Compression, 3, 1, 1, false },
+		{ MiniTiff::IFD_PhotometricInterpretation, 3, 1, 2, false },
+		{ MiniTiff::IFD_NumComponents, 3, 1, 3, false },
+		}, extra, { std::vector< uint8_t >(16) }))
+		return false;
+	MiniTiff::ImageInfo info = MiniTiff::probe(ofilename);
+	if (!info.is_valid || info.bits_per_component != 0 || MiniTiff::load(ofilename, [](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) { return true; }))
+		return false;
+
+	// The tables of the strips are not read with the IFD, as in probe, only by getBlocks when the pixels are needed
+	const char* strips_filename = "saved_strips.tif";
+	if (!saveRaw(strips_filename, {
+		{ MiniTiff::IFD_Width, 4, 1, 4, false },
+		{ MiniTiff::IFD_Height, 4, 1, 3, false },
+		{ MiniTiff::IFD_BitsPerSample, 3, 1, 8, false },
+		{ MiniTiff::IFD_Compression, 3, 1, 1, false },
+		{ MiniTiff::IFD_PhotometricInterpretation, 3, 1, 1, false },
+		{ MiniTiff::IFD_NumComponents, 3, 1, 1, false },
+		{ MiniTiff::IFD_RowsPerStrip, 4, 1, 1, false },
+		}, {}, { { 1, 2, 3, 4 }, { 5, 6, 7, 8 }, { 9, 10, 11, 12 } }))
+		return false;
+	return MiniTiff::load(strips_filename, [](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+		const MiniTiff::IFD::Entry* offsets = f.ifd.find(MiniTiff::IFD_OffsetForData);
+		if (f.info.num_strips != 3 || !offsets || offsets->data_at != ~0u)
+			return false;
+		MiniTiff::FileReader::Blocks blocks;
+		return f.getBlocks(blocks) && blocks.offsets.size() == 3 && blocks.offsets[1] == blocks.offsets[0] + 4 && blocks.sizes[2] == 4;
+		});
+}
+
+// Counts of the entries can't make the reader allocate more than the budget of the IFD, whatever the file says.
+// Arrays over it are read on demand, and the ones past the end of the file never
+bool testLargeIFD() {
+	const char* ofilename = "saved_large_ifd.tif";
+	std::vector< RawEntry > entries = {
+		{ MiniTiff::IFD_Width, 4, 1, 2, false },
+		{ MiniTiff::IFD_Height, 4, 1, 2, false },
+		{ MiniTiff::IFD_BitsPerSample, 3, 1, 8, false },
+		{ MiniTiff::IFD_Compression, 3, 1, 1, false },
+		{ MiniTiff::IFD_PhotometricInterpretation, 3, 1, 1, false },
+		{ MiniTiff::IFD_NumComponents, 3, 1, 1, false },
+	};
+	// 100 arrays of doubles of 60Mb each, not in the file
+	for (uint16_t i = 0; i < 100; ++i)
+		entries.push_back({ (uint16_t)(0xC400 + i), 12, (60 << 20) / 8, 4096, false });
+	// An array in the file, but longer than the budget
+	std::vector< uint32_t > ints(MiniTiff::IFD::max_array_bytes / 4 + 10);
+	for (size_t i = 0; i < ints.size(); ++i)
+		ints[i] = (uint32_t)(i * 2654435761u);
+	std::vector< uint8_t > extra((const uint8_t*)ints.data(), (const uint8_t*)(ints.data() + ints.size()));
+	entries.push_back({ 0xC350, 4, (uint32_t)ints.size(), 0, true });
+	if (!saveRaw(ofilename, entries, extra, { { 1, 2, 3, 4 } }))
+		return false;
+
+	if (!MiniTiff::probe(ofilename).is_valid)
+		return false;
+	return MiniTiff::load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+		std::vector< uint8_t > values;
+		if (f.ifd.doubles(0xC400) || f.readBlob(0xC400, values) || f.ifd.ints(0xC350))
+			return false;
+		if (f.blobSize(0xC350) != ints.size() * 4 || !f.readBlob(0xC350, values) || memcmp(values.data(), ints.data(), values.size()) != 0)
+			return false;
+		uint8_t pixels[4];
+		return f.readImage(pixels) && pixels[3] == 4;
+		});
+}
+
+// The metadata of SaveOptions is found by the reader, also written by the ScanlineWriter
+bool testMetadata(bool by_rows) {
+	const char* ofilename = "saved_metadata.tif";
+	const int w = 3, h = 3;
+	uint8_t pixels[w * h] = { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+	std::vector< uint8_t > icc(333);
+	for (size_t i = 0; i < icc.size(); ++i)
+		icc[i] = (uint8_t)(i * 7);
+	const char xmp[] = "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\"></x:xmpmeta>";
+	MiniTiff::SaveOptions options;
+	options.x_resolution = 300.0f;
+	options.y_resolution = 150.5f;
+	options.resolution_unit = 3;
+	options.software = "mini_tiff";
+	options.date_time = "2024:01:02 03:04:05";
+	options.icc_profile = icc.data();
+	options.icc_profile_size = icc.size();
+	options.xmp = xmp;
+	options.xmp_size = sizeof(xmp) - 1;
+	if (by_rows) {
+		MiniTiff::ScanlineWriter writer;
+		if (!writer.create(ofilename, w, h, 1, 8, options) || !writer.writeRows(pixels, h) || !writer.close())
+			return false;
+	}
+	else if (!MiniTiff::save(ofilename, w, h, 1, 8, pixels, options))
+		return false;
+
+	// transcode keeps the same metadata
+	auto check = [&](const char* filename) {
+		return MiniTiff::load(filename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+			const MiniTiff::IFD& ifd = f.ifd;
+			float resolution[2] = {};
+			if (!ifd.rationals(MiniTiff::IFD_XResolution, resolution, 1) || !ifd.rationals(MiniTiff::IFD_YResolution, resolution + 1, 1))
+				return false;
+			if (resolution[0] != 300.0f || resolution[1] < 150.49f || resolution[1] > 150.51f || ifd.get(MiniTiff::IFD_ResolutionUnits) != 3)
+				return false;
+			if (!ifd.text(MiniTiff::IFD_Software) || strcmp(ifd.text(MiniTiff::IFD_Software), options.software) != 0)
+				return false;
+			if (!ifd.text(MiniTiff::IFD_DateTime) || strcmp(ifd.text(MiniTiff::IFD_DateTime), options.date_time) != 0)
+				return false;
+			// Blobs are read on demand, in even offsets
+			std::vector< uint8_t > icc_read, xmp_read;
+			if ((ifd.offset(MiniTiff::IFD_ICCProfile) & 1) || !f.readBlob(MiniTiff::IFD_ICCProfile, icc_read) || icc_read != icc)
+				return false;
+			if (!f.readBlob(MiniTiff::IFD_XMLPacket, xmp_read) || xmp_read.size() != sizeof(xmp) - 1 || memcmp(xmp_read.data(), xmp, xmp_read.size()) != 0)
+				return false;
+			if (f.blobSize(MiniTiff::IFD_Photoshop) != 0 || f.readBlob(MiniTiff::IFD_Photoshop, xmp_read))
+				return false;
+			uint8_t read[sizeof(pixels)];
+			return f.readImage(read) && memcmp(read, pixels, sizeof(read)) == 0;
+		});
+	};
+	const char* transcoded = "saved_metadata_transcoded.tif";
+	MiniTiff::TranscodeOptions transcode_options;
+	transcode_options.compression = MiniTiff::Compression_PackBits;
+	return check(ofilename) && MiniTiff::transcode(ofilename, transcoded, transcode_options) && check(transcoded);
+}
+
+// A file with Exif and GPS sub-IFDs, which are found reading just the IFDs
+bool testExif() {
+	const char* ofilename = "saved_exif.tif";
+	std::vector< RawEntry > entries = {
+		{ MiniTiff::IFD_Width, 4, 1, 2, false },
+		{ MiniTiff::IFD_Height, 4, 1, 2, false },
+		{ MiniTiff::IFD_BitsPerSample, 3, 1, 8, false },
+		{ MiniTiff::IFD_Compression, 3, 1, 1, false },
+		{ MiniTiff::IFD_PhotometricInterpretation, 3, 1, 1, false },
+		{ MiniTiff::IFD_NumComponents, 3, 1, 1, false },
+		{ MiniTiff::IFD_Exif, 4, 1, 0, true },
+		{ MiniTiff::IFD_GPS, 4, 1, 66, true },
+	};
+	// Where saveRaw writes extra, after the IFD with the offsets and sizes of the strip
+	uint32_t extra_at = 8 + 2 + (uint32_t)(entries.size() + 2) * 12 + 4;
+	std::vector< uint8_t > extra;
+	auto put = [&](const void* data, size_t n) { extra.insert(extra.end(), (const uint8_t*)data, (const uint8_t*)data + n); };
+	auto entry = [&](uint16_t id, uint16_t type, uint32_t count, uint32_t value) {
+		put(&id, 2);
+		put(&type, 2);
+		put(&count, 4);
+		put(&value, 4);
+	};
+	const uint32_t values_at = extra_at + 144;
+	const char date[20] = "2024:05:06 07:08:09";
+	uint32_t rationals[] = { 1, 250, 28, 10, 50, 1, 40, 1, 26, 1, 4630, 100, 79, 1, 58, 1, 5600, 100, 1200, 10 };
+	uint16_t n = 5;
+	uint32_t next_ifd = 0;
+	put(&n, 2);
+	entry(0x829A, 5, 1, values_at);
+	entry(0x829D, 5, 1, values_at + 8);
+	entry(0x8827, 3, 1, 400);
+	entry(0x9003, 2, 20, values_at + sizeof(rationals));
+	entry(0x920A, 5, 1, values_at + 16);
+	put(&next_ifd, 4);
+	n = 6;
+	put(&n, 2);
+	entry(1, 2, 2, 'S');
+	entry(2, 5, 3, values_at + 24);
+	entry(3, 2, 2, 'W');
+	entry(4, 5, 3, values_at + 48);
+	entry(5, 1, 1, 1);
+	entry(6, 5, 1, values_at + 72);
+	put(&next_ifd, 4);
+	put(rationals, sizeof(rationals));
+	put(date, sizeof(date));
+	std::vector< uint8_t > pixels = { 10, 20, 30, 40 };
+	if (extra.size() != 144 + sizeof(rationals) + sizeof(date) || !saveRaw(ofilename, entries, extra, { pixels }))
+		return false;
+
+	auto check = [&](const MiniTiff::ExifInfo& exif) {
+		auto near = [](double a, double b) { return a > b - 1e-4 && a < b + 1e-4; };
+		return exif.has_exif && exif.has_gps && exif.iso == 400 && strcmp(exif.date_time_original, date) == 0
+			&& near(exif.exposure_time, 0.004) && near(exif.f_number, 2.8) && near(exif.focal_length, 50.0)
+			&& near(exif.latitude, -(40.0 + 26.0 / 60.0 + 46.3 / 3600.0)) && near(exif.longitude, -(79.0 + 58.0 / 60.0 + 56.0 / 3600.0))
+			&& near(exif.altitude, -120.0);
+	};
+	MiniTiff::ExifInfo exif;
+	if (!MiniTiff::exif(ofilename, exif) || !check(exif))
+		return false;
+
+	// In the load callback, the pixels are still there after reading the metadata
+	bool is_ok = MiniTiff::load(ofilename, [&](int w, int h, int num_comps, int bits_per_comp, MiniTiff::FileReader& f) {
+		std::vector< uint8_t > read(4);
+		return f.readExif(exif) && check(exif) && f.readBytes(read.data(), read.size()) && read == pixels;
+		});
+
+	// Photoshop files have an Exif sub-IFD, without GPS
+	return is_ok && MiniTiff::exif("RGB_32x32_16b_BE.tif", exif) && exif.has_exif && !exif.has_gps
+		&& MiniTiff::exif("RGB_32x32_8b.tif", exif) && exif.has_exif && !MiniTiff::exif("saved_metadata.tif", exif);
+}
+
 int main(int argc, char** argv) {
 
 	//Test tests[2] = {
@@ -108,6 +1360,176 @@ int main(int argc, char** argv) {
 		}
 		//break;
 	}
+
+	// Probe all the files at once
+	std::vector< std::string > filenames;
+	for (auto& t : tests)
+		if (t.filename)
+			filenames.push_back(t.filename);
+	std::vector< MiniTiff::ImageInfo > infos = MiniTiff::scan(filenames, 4);
+	++n_tests;
+	bool scan_ok = infos.size() == filenames.size();
+	for (size_t i = 0; scan_ok && i < infos.size(); ++i)
+		scan_ok = infos[i].is_valid && infos[i].w == tests[i].w && infos[i].h == tests[i].h;
+	if (scan_ok)
+		n_ok++;
+	else
+		printf("scan failed\n");
+
+	n_tests += 2;
+	if (testHalf(37, 11))
+		n_ok++;
+	else
+		printf("Half floats failed\n");
+	if (testHalf(1000, 100))
+		n_ok++;
+	else
+		printf("Half floats failed\n");
+
+	n_tests += 4;
+	n_ok += testSampleFormat< int8_t >(MiniTiff::SampleFormat_Int) ? 1 : 0;
+	n_ok += testSampleFormat< int16_t >(MiniTiff::SampleFormat_Int) ? 1 : 0;
+	n_ok += testSampleFormat< int32_t >(MiniTiff::SampleFormat_Int) ? 1 : 0;
+	n_ok += testSampleFormat< double >(MiniTiff::SampleFormat_Float) ? 1 : 0;
+
+	for (int bits : { 1, 2, 4 }) {
+		++n_tests;
+		if (testPacked< uint8_t >(bits, 13, 5, 1) && testPacked< uint8_t >(bits, 7, 3, 3) && testPacked< uint8_t >(bits, 100003, 2, 1))
+			n_ok++;
+	}
+	++n_tests;
+	if (testPacked< uint16_t >(12, 13, 5, 1) && testPacked< uint16_t >(12, 8, 3, 3) && testPacked< uint16_t >(12, 8195, 2, 1))
+		n_ok++;
+
+	for (int bits : { 4, 8 }) {
+		++n_tests;
+		if (testPalette(bits, 0) && testPalette(bits, 2))
+			n_ok++;
+		else
+			printf("Palette %d bits failed\n", bits);
+	}
+
+	++n_tests;
+	if (testCMYK(0) && testCMYK(1))
+		n_ok++;
+	else
+		printf("CMYK failed\n");
+
+	for (int subsampling : { 0x11, 0x21, 0x22, 0x42 }) {
+		++n_tests;
+		if (testYCbCr(subsampling >> 4, subsampling & 15, false) && testYCbCr(subsampling >> 4, subsampling & 15, true))
+			n_ok++;
+		else
+			printf("YCbCr %dx%d failed\n", subsampling >> 4, subsampling & 15);
+	}
+
+	++n_tests;
+	if (testBlocks())
+		n_ok++;
+	else
+		printf("Tiles/strips failed\n");
+
+	++n_tests;
+	if (testOrientation())
+		n_ok++;
+	else
+		printf("Orientation failed\n");
+
+	++n_tests;
+	if (testScanlineWriter< uint16_t >(17, 13, 3, 16, MiniTiff::Compression_None, 4)
+		&& testScanlineWriter< uint8_t >(33, 9, 1, 8, MiniTiff::Compression_None, 0)
+		&& testScanlineWriter< uint8_t >(40, 21, 4, 8, MiniTiff::Compression_PackBits, 0)
+		&& testScanlineWriter< uint8_t >(23, 10, 1, 4, MiniTiff::Compression_PackBits, 3))
+		n_ok++;
+	else
+		printf("ScanlineWriter failed\n");
+
+	++n_tests;
+	if (testTileWriter(37, 21, MiniTiff::Compression_None) && testTileWriter(70, 50, MiniTiff::Compression_PackBits) && testTileWriter(10, 12, MiniTiff::Compression_None))
+		n_ok++;
+	else
+		printf("TileWriter failed\n");
+
+	for (bool by_rows : { false, true }) {
+		++n_tests;
+		if (testMetadata(by_rows))
+			n_ok++;
+		else
+			printf("Metadata %s failed\n", by_rows ? "by rows" : "");
+	}
+
+	++n_tests;
+	if (testExif())
+		n_ok++;
+	else
+		printf("Exif failed\n");
+
+	++n_tests;
+	if (testIFD())
+		n_ok++;
+	else
+		printf("IFD failed\n");
+
+	++n_tests;
+	if (testLargeIFD())
+		n_ok++;
+	else
+		printf("Large IFD failed\n");
+
+	for (const char* filename : { "RGB_32x32_16b_BE.tif", "saved_tiles.tif", "brain_604.tif" }) {
+		++n_tests;
+		if (testUpdateTags(filename))
+			n_ok++;
+		else
+			printf("UpdateTags %s failed\n", filename);
+	}
+
+	for (const char* filename : { "RGB_32x32_16b_BE.tif", "saved_tiles.tif", "saved_scanlines.tif" }) {
+		++n_tests;
+		if (testTranscode(filename))
+			n_ok++;
+		else
+			printf("Transcode %s failed\n", filename);
+	}
+
+	++n_tests;
+	if (testConvertedBlocks())
+		n_ok++;
+	else
+		printf("Converted blocks failed\n");
+
+	++n_tests;
+	if (testTranscodeFloatTiles())
+		n_ok++;
+	else
+		printf("Transcode float tiles failed\n");
+
+	++n_tests;
+	if (testInstrumentation())
+		n_ok++;
+	else
+		printf("Instrumentation failed\n");
+
+	++n_tests;
+	if (testFilePoolReplaced())
+		n_ok++;
+	else
+		printf("File pool replaced failed\n");
+
+	++n_tests;
+	if (saveRegionStrips("saved_region_strips.tif"))
+		n_ok++;
+	else
+		printf("Save region strips failed\n");
+
+	for (const char* filename : { "brain_604.tif", "RGB_32x32_16b_BE.tif", "saved_tiles.tif", "saved_float_tiles_transcoded.tif", "saved_region_strips.tif" }) {
+		++n_tests;
+		if (testTileCache(filename))
+			n_ok++;
+		else
+			printf("TileCache %s failed\n", filename);
+	}
+
 	printf("%d/%d OK\n", n_ok, n_tests);
 	return n_ok == n_tests ? 0 : -1;
 }